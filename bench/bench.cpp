@@ -0,0 +1,237 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include "dbfs.hpp"
+
+using namespace std;
+
+using clock_type = chrono::steady_clock;
+
+// Per thread hooks: prepare state before timing, run one timed operation,
+// cleanup after all threads are done
+struct bench_case{
+	string name;
+	function<void(int thread, int iterations)> setup;
+	function<void(int thread, int iteration)> run;
+	function<void(int thread)> teardown;
+	long bytes = 0;
+};
+
+struct bench_result{
+	double ops;
+	double mbps;
+	long p50, p99, p999;
+};
+
+int max_threads = 4;
+int iterations = 2000;
+vector<int> block_sizes = {512, 4096, 65536};
+
+bench_result measure(bench_case& bc, int threads)
+{
+	vector<vector<long>> lat(threads);
+	for(int t=0;t<threads;t++){
+		if(bc.setup){
+			bc.setup(t, iterations);
+		}
+		lat[t].reserve(iterations);
+	}
+	
+	vector<thread> v;
+	auto start = clock_type::now();
+	for(int t=0;t<threads;t++){
+		v.emplace_back([&bc, &lat](int ind){
+			for(int i=0;i<iterations;i++){
+				auto s = clock_type::now();
+				bc.run(ind, i);
+				lat[ind].push_back(chrono::duration_cast<chrono::nanoseconds>(clock_type::now() - s).count());
+			}
+		}, t);
+	}
+	for(auto& it : v){
+		it.join();
+	}
+	double secs = chrono::duration<double>(clock_type::now() - start).count();
+	
+	for(int t=0;t<threads;t++){
+		if(bc.teardown){
+			bc.teardown(t);
+		}
+	}
+	
+	vector<long> all;
+	for(auto& it : lat){
+		all.insert(all.end(), it.begin(), it.end());
+	}
+	sort(all.begin(), all.end());
+	auto pct = [&all](double p){ return all[min(all.size() - 1, (size_t)(all.size() * p))]; };
+	
+	bench_result res;
+	res.ops = all.size() / secs;
+	res.mbps = bc.bytes * res.ops / (1024.0 * 1024.0);
+	res.p50 = pct(0.5);
+	res.p99 = pct(0.99);
+	res.p999 = pct(0.999);
+	return res;
+}
+
+void report(bench_case& bc)
+{
+	for(int threads=1;threads<=max_threads;threads*=2){
+		bench_result r = measure(bc, threads);
+		cout << left << setw(28) << bc.name
+			<< right << setw(4) << threads << "t"
+			<< setw(14) << fixed << setprecision(0) << r.ops << " ops/s";
+		if(bc.bytes){
+			cout << setw(10) << setprecision(1) << r.mbps << " MiB/s";
+		}
+		else{
+			cout << setw(16) << "";
+		}
+		cout << "   p50 " << setw(8) << r.p50 << "ns"
+			<< "   p99 " << setw(9) << r.p99 << "ns"
+			<< "   p999 " << setw(10) << r.p999 << "ns" << endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1){
+		max_threads = stoi(argv[1]);
+	}
+	if(argc > 2){
+		iterations = stoi(argv[2]);
+	}
+	
+	DBFS::set_root("tmp_bench");
+	
+	// Names and files prepared per thread outside of timed region
+	vector<vector<string>> names(max_threads);
+	vector<vector<string>> new_names(max_threads);
+	vector<DBFS::File*> files(max_threads);
+	vector<vector<char>> bufs(max_threads);
+	vector<mt19937> rnd(max_threads);
+	
+	auto make_names = [&](int t, int n){
+		names[t].clear();
+		for(int i=0;i<n;i++){
+			names[t].push_back(DBFS::random_filename());
+		}
+	};
+	auto make_files = [&](int t, int n){
+		make_names(t, n);
+		for(auto& it : names[t]){
+			DBFS::create(it)->close();
+		}
+	};
+	auto remove_files = [&](int t){
+		for(auto& it : names[t]){
+			DBFS::remove(it);
+		}
+		names[t].clear();
+	};
+	
+	vector<bench_case> cases;
+	
+	cases.push_back({"random_filename", nullptr, [](int t, int i){ DBFS::random_filename(); }, nullptr});
+	
+	cases.push_back({"create", make_names, [&](int t, int i){
+		delete DBFS::create(names[t][i]);
+	}, remove_files});
+	
+	cases.push_back({"open", make_files, [&](int t, int i){
+		delete new DBFS::File(names[t][i]);
+	}, remove_files});
+	
+	cases.push_back({"exists", make_files, [&](int t, int i){
+		DBFS::exists(names[t][i]);
+	}, remove_files});
+	
+	cases.push_back({"move", [&](int t, int n){
+		make_files(t, n);
+		new_names[t].clear();
+		for(int i=0;i<n;i++){
+			new_names[t].push_back(DBFS::random_filename());
+		}
+	}, [&](int t, int i){
+		DBFS::move(names[t][i], new_names[t][i]);
+	}, [&](int t){
+		names[t] = new_names[t];
+		remove_files(t);
+	}});
+	
+	cases.push_back({"remove", make_files, [&](int t, int i){
+		DBFS::remove(names[t][i]);
+	}, [&](int t){ names[t].clear(); }});
+	
+	for(int bs : block_sizes){
+		auto open_file = [&, bs](int t, int n){
+			files[t] = DBFS::create();
+			bufs[t].assign(bs, 'x');
+			rnd[t].seed(t);
+		};
+		auto fill_file = [&, bs, open_file](int t, int n){
+			open_file(t, n);
+			for(int i=0;i<n;i++){
+				files[t]->write(bufs[t].data(), bs);
+			}
+			files[t]->seekg(0);
+		};
+		auto close_file = [&](int t){
+			files[t]->remove();
+			delete files[t];
+		};
+		string sz = to_string(bs);
+		
+		cases.push_back({"write seq " + sz, open_file, [&, bs](int t, int i){
+			files[t]->write(bufs[t].data(), bs);
+		}, close_file, bs});
+		
+		cases.push_back({"read seq " + sz, fill_file, [&, bs](int t, int i){
+			files[t]->read(bufs[t].data(), bs);
+		}, close_file, bs});
+		
+		cases.push_back({"write random " + sz, fill_file, [&, bs](int t, int i){
+			files[t]->seekp((long)(rnd[t]() % iterations) * bs);
+			files[t]->write(bufs[t].data(), bs);
+		}, close_file, bs});
+		
+		cases.push_back({"read random " + sz, fill_file, [&, bs](int t, int i){
+			files[t]->seekg((long)(rnd[t]() % iterations) * bs);
+			files[t]->read(bufs[t].data(), bs);
+		}, close_file, bs});
+		
+		cases.push_back({"read_at random " + sz, fill_file, [&, bs](int t, int i){
+			files[t]->read_at((long)(rnd[t]() % iterations) * bs, bufs[t].data(), bs);
+		}, close_file, bs});
+	}
+	
+	// Forward seek inside of the stream buffer, served by in_avail()
+	cases.push_back({"seekg fast path", [&](int t, int n){
+		files[t] = DBFS::create();
+		bufs[t].assign(n * 2 + 16, 'x');
+		files[t]->write(bufs[t].data(), bufs[t].size());
+		files[t]->seekg(0);
+		char c;
+		files[t]->read(&c, 1);
+	}, [&](int t, int i){
+		files[t]->seekg(i * 2 + 1);
+	}, [&](int t){
+		files[t]->remove();
+		delete files[t];
+	}});
+	
+	cout << "threads: 1.." << max_threads << ", iterations per thread: " << iterations << endl;
+	for(auto& it : cases){
+		report(it);
+	}
+	
+	DBFS::details::rmdir("tmp_bench");
+	return 0;
+}
@@ -1,18 +1,250 @@
 #include "dbfs.hpp"
+#include "dbfs_manifest.hpp"
 
 namespace DBFS{
 	
-	std::mt19937 mt_rand(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+	// Unique part of generated names, handed out to threads in blocks
+	std::atomic<unsigned long long> name_seq{0};
+	const int name_seq_block = 1024;
 	
 	string root = ".";
 	string suffix = "";
 	string prefix = "";
 	int filelength = 10;
-	std::mutex mtx;
-	std::mutex mtx_r;
+	int dir_levels = 2;
+	int dir_width = 2;
 	bool suffix_minutex = true;
 	
+	// Striped by leaf directory, see details::stripe
 	std::mutex mtxs[36*36];
+	
+	int max_open_files = 0;
+	// Stream buffer of newly opened files, 0 keeps the library default
+	pos_t buffer_size = 0;
+	
+	// Offsets, sizes and buffers of direct I/O must be multiples of it
+	pos_t direct_align = 4096;
+	
+	// Scan mode drops consumed pages in steps of this size
+	const pos_t scan_window = 1 << 20;
+	
+	// Blocks of files read by read_at, shared by all File instances. Blocks
+	// are spread over shards by name and block index, so readers of one hot
+	// file do not queue on a single lock. Replacement is CLOCK over the slots
+	// of a shard. `cache_epochs` grow on every invalidation of names hashed
+	// to them, a block read before it is not stored. `cache_renames` grow when
+	// a name is moved or removed, File instances then check their descriptor
+	// still backs the name before using the cache
+	const int cache_shards = 64;
+	std::atomic<pos_t> cache_block{0};
+	std::atomic<unsigned long long> cache_epochs[cache_shards];
+	std::atomic<unsigned long long> cache_renames[cache_shards];
+	struct cache_slot{
+		const string* name = nullptr;
+		pos_t block = 0;
+		pos_t size = 0;
+		bool ref = false;
+	};
+	struct cache_shard{
+		std::mutex mtx;
+		std::vector<char> data;
+		std::vector<cache_slot> slots;
+		size_t hand = 0;
+		std::unordered_map<string, std::unordered_map<pos_t, size_t>> files;
+	};
+	cache_shard& get_cache_shard(size_t index);
+	cache_shard& get_cache_shard(const string& filename, pos_t block);
+	size_t cache_stripe(const string& filename);
+	void cache_erase(cache_shard& sh, const string& filename, pos_t from, pos_t to);
+	
+	// Aligned buffers returned by free_iobuf, by power of 2 size class.
+	// Buffers of huge page size and larger are mapped, smaller are allocated
+	const int iobuf_classes = 48;
+	const pos_t iobuf_huge = 2 << 20;
+	const pos_t iobuf_cache_limit = 64 << 20;
+	std::mutex iobuf_mtx;
+	std::vector<char*> iobuf_free[iobuf_classes];
+	pos_t iobuf_cached = 0;
+	bool huge_pages = false;
+	std::mutex pool_mtx;
+	std::list<DBFS::File*> pool;
+	// Descriptors held by pooled files, a file has up to two: the stream
+	// and the one used for positional I/O
+	int pool_fds = 0;
+	
+	// Directories known to exist, so create_path skips their mkdir. A shard
+	// is dropped as a whole once it grows past the limit
+	const int dir_cache_shards = 64;
+	const size_t dir_cache_limit = 1 << 16;
+	std::shared_mutex dir_cache_mtx[dir_cache_shards];
+	std::unordered_set<string> dir_cache[dir_cache_shards];
+	
+	// Directories made by create_path whose entry in the parent may not be
+	// synced yet, see details::sync_path. Once the set overflows it is
+	// dropped and sync_path walks up to root every time
+	const size_t fresh_dirs_limit = 1 << 16;
+	std::mutex fresh_dirs_mtx;
+	std::unordered_set<string> fresh_dirs;
+	bool fresh_dirs_lost = false;
+	
+	// Names of all files under root, see DBFS::load_catalog.
+	// 0 - off, 1 - tracking changes while loading, 2 - used by exists()
+	const int catalog_shards = 64;
+	std::atomic<int> catalog_state{0};
+	std::shared_mutex catalog_mtx[catalog_shards];
+	std::unordered_set<string> catalog[catalog_shards];
+	// Names removed while the catalog is loading, the scan may have listed
+	// them before the remove and must not bring them back
+	std::unordered_set<string> catalog_removed[catalog_shards];
+	
+	// Empty directories left by remove/move, removed by DBFS::start_reaper thread
+	std::atomic<bool> reaper_on{false};
+	bool reaper_stop = false;
+	int reaper_rate = 0;
+	std::mutex reaper_mtx;
+	std::condition_variable reaper_cv;
+	std::thread reaper;
+	// Leaf directories to try, one set per stripe guarded by the stripe lock
+	// that remove/move already hold
+	std::unordered_set<string> reaper_dirs[36*36];
+	std::atomic<size_t> reaper_pending{0};
+	
+	// Joins reaper thread before static destruction
+	struct reaper_guard_t{
+		~reaper_guard_t(){ stop_reaper(); }
+	} reaper_guard;
+	
+	// Files waiting for DBFS::commit, synced together by the group commit
+	// thread. Result of each file is set before `done`
+	struct commit_batch{
+		std::unordered_map<File*, bool> files;
+		std::unordered_set<string> dirs;
+		bool dirs_ok = false;
+		bool done = false;
+	};
+	std::atomic<bool> commit_on{false};
+	bool commit_stop = false;
+	int commit_window = 0;
+	std::mutex commit_mtx;
+	std::condition_variable commit_cv;
+	std::shared_ptr<commit_batch> commit_next;
+	std::thread committer;
+	
+	struct commit_guard_t{
+		~commit_guard_t(){ stop_group_commit(); }
+	} commit_guard;
+	
+	// Threads take rw_mutex reader slots round robin
+	std::atomic<unsigned> rw_next_slot{0};
+	#ifdef DBFS_METRICS
+		// Shared locks held by this thread with their acquire time
+		thread_local std::vector<std::pair<const rw_mutex*, std::chrono::steady_clock::time_point>> rw_held;
+	#endif
+}
+
+DBFS::rw_mutex::slot& DBFS::rw_mutex::local()
+{
+	thread_local unsigned index = rw_next_slot.fetch_add(1, std::memory_order_relaxed) % slots;
+	return readers[index];
+}
+
+void DBFS::rw_mutex::lock()
+{
+	#ifdef DBFS_METRICS
+		auto start = std::chrono::steady_clock::now();
+	#endif
+	wmtx.lock();
+	// New readers back off once `writer` is seen, the ones inside are waited out
+	writer.store(true);
+	for(int i=0;i<slots;i++){
+		while(readers[i].readers.load() > 0){
+			std::this_thread::yield();
+		}
+	}
+	#ifdef DBFS_METRICS
+		held = std::chrono::steady_clock::now();
+		metrics::record(metrics::LOCK_WAIT, std::chrono::duration_cast<std::chrono::nanoseconds>(held - start).count(), 0, false);
+	#endif
+}
+
+void DBFS::rw_mutex::unlock()
+{
+	#ifdef DBFS_METRICS
+		metrics::record(metrics::LOCK_HOLD, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - held).count(), 0, false);
+	#endif
+	writer.store(false);
+	wmtx.unlock();
+}
+
+bool DBFS::rw_mutex::try_lock()
+{
+	if(!wmtx.try_lock()){
+		return false;
+	}
+	writer.store(true);
+	for(int i=0;i<slots;i++){
+		if(readers[i].readers.load() > 0){
+			writer.store(false);
+			wmtx.unlock();
+			return false;
+		}
+	}
+	#ifdef DBFS_METRICS
+		held = std::chrono::steady_clock::now();
+		metrics::record(metrics::LOCK_WAIT, 0, 0, false);
+	#endif
+	return true;
+}
+
+void DBFS::rw_mutex::lock_shared()
+{
+	#ifdef DBFS_METRICS
+		auto start = std::chrono::steady_clock::now();
+	#endif
+	slot& s = local();
+	while(true){
+		s.readers.fetch_add(1);
+		if(!writer.load()){
+			break;
+		}
+		// Sleep on the writer's mutex instead of spinning until it is done
+		s.readers.fetch_sub(1);
+		std::lock_guard<std::mutex> wait(wmtx);
+	}
+	#ifdef DBFS_METRICS
+		auto now = std::chrono::steady_clock::now();
+		metrics::record(metrics::LOCK_WAIT, std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count(), 0, false);
+		rw_held.emplace_back(this, now);
+	#endif
+}
+
+void DBFS::rw_mutex::unlock_shared()
+{
+	#ifdef DBFS_METRICS
+		for(size_t i=rw_held.size();i-->0;){
+			if(rw_held[i].first == this){
+				metrics::record(metrics::LOCK_HOLD, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - rw_held[i].second).count(), 0, false);
+				rw_held.erase(rw_held.begin() + i);
+				break;
+			}
+		}
+	#endif
+	local().readers.fetch_sub(1);
+}
+
+bool DBFS::rw_mutex::try_lock_shared()
+{
+	slot& s = local();
+	s.readers.fetch_add(1);
+	if(writer.load()){
+		s.readers.fetch_sub(1);
+		return false;
+	}
+	#ifdef DBFS_METRICS
+		metrics::record(metrics::LOCK_WAIT, 0, 0, false);
+		rw_held.emplace_back(this, std::chrono::steady_clock::now());
+	#endif
+	return true;
 }
 
 DBFS::File::File()
@@ -23,6 +255,7 @@ DBFS::File::File()
 DBFS::File::~File()
 {
 	close();
+	delete rw.load();
 }
 
 DBFS::File::File(string filename)
@@ -39,6 +272,13 @@ DBFS::File::File(string filename, file_hook_fn onopen, file_hook_fn onclose)
 
 bool DBFS::File::open()
 {
+	DBFS_METRIC_START(metric, OPEN);
+	unmap();
+	std::unique_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::unique_lock<std::shared_mutex>(hmtx);
+	}
+	
 	if(is_open() && fail()){
 		#ifdef DEBUG
 		SHOW_ERROR;
@@ -47,16 +287,12 @@ bool DBFS::File::open()
 		return true;
 	}
 	
-	int trys = 5;
-	int try_ms = 1;
-	while(trys--){
-		st = create_stream(filename);
-		if(!fail()){
-			break;
-		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(try_ms));
-		try_ms *= 10;
+	if(pooled){
+		details::pool_remove(this);
 	}
+	close_fd();
+	evicted = false;
+	open_stream();
 	p_updated = g_updated = false;
 	
 	#ifdef DEBUG
@@ -66,6 +302,15 @@ bool DBFS::File::open()
 	}
 	#endif
 	
+	if(!fail() && max_open_files > 0){
+		details::pool_add(this);
+	}
+	if(lock.owns_lock()){
+		lock.unlock();
+	}
+	
+	DBFS_METRIC_DONE(metric, 0, fail());
+	
 	for(auto& it : on_open_fns){
 		it(this);
 	}
@@ -73,6 +318,74 @@ bool DBFS::File::open()
 	return opened = !fail();
 }
 
+bool DBFS::File::open_stream()
+{
+	int trys = 5;
+	int try_ms = 1;
+	// Old stream may still flush through iobuf_data, which create_stream reuses
+	if(st.is_open()){
+		st.close();
+	}
+	while(trys--){
+		st = create_stream(filename);
+		if(!fail()){
+			break;
+		}
+		// Out of descriptors: give back an idle one instead of waiting
+		DBFS_METRIC_RETRY(OPEN);
+		if((errno == EMFILE || errno == ENFILE) && details::pool_evict(this)){
+			trys++;
+			continue;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(try_ms));
+		try_ms *= 10;
+	}
+	return !fail();
+}
+
+bool DBFS::File::reopen()
+{
+	if(!open_stream()){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	evicted = false;
+	st.seekp(evict_pos);
+	st.setstate(evict_state);
+	if(max_open_files > 0){
+		details::pool_add(this);
+	}
+	return true;
+}
+
+void DBFS::File::evict()
+{
+	if(!evicted){
+		flush_stream();
+		evict_state = st.rdstate();
+		evict_pos = st.fail() ? 0 : (pos_t)st.tellp();
+		st.close();
+		evicted = true;
+	}
+	close_fd();
+}
+
+std::unique_lock<std::shared_mutex> DBFS::File::hold()
+{
+	if(max_open_files <= 0 && !evicted){
+		return std::unique_lock<std::shared_mutex>();
+	}
+	std::unique_lock<std::shared_mutex> lock(hmtx);
+	if(evicted && opened){
+		reopen();
+	}
+	pool_ref.store(true, std::memory_order_relaxed);
+	return lock;
+}
+
 bool DBFS::File::open(string filename)
 {
 	if(is_open() && !fail())
@@ -81,15 +394,301 @@ bool DBFS::File::open(string filename)
 	return open();
 }
 
+bool DBFS::File::flush()
+{
+	auto lock = hold();
+	flush_stream();
+	return !fail();
+}
+
+void DBFS::File::flush_stream()
+{
+	st.flush();
+	if(cache_dirty){
+		cache_dirty = false;
+		cache_start = cache_end = -1;
+		details::cache_drop(filename);
+	}
+}
+
+DBFS::pos_t DBFS::File::cache_from()
+{
+	if(cache_block.load(std::memory_order_relaxed) <= 0){
+		return -1;
+	}
+	return p_updated ? pos_p : (pos_t)st.tellp();
+}
+
+void DBFS::File::cache_written(pos_t from, pos_t to)
+{
+	// Whatever the put area does not hold anymore has reached the file.
+	// Writes that stay in the buffer leave the cache alone
+	to = std::max(to, from);
+	pos_t start = cache_start >= 0 ? std::min(cache_start, from) : from;
+	pos_t pending = std::max(to - details::put_pending(st.rdbuf()), start);
+	if(pending > start){
+		details::cache_invalidate(filename, start, pending - start);
+	}
+	cache_start = pending < to ? pending : -1;
+	cache_end = pending < to ? to : -1;
+}
+
+void DBFS::File::cache_pushed()
+{
+	// Seeks and reads write the stream buffer out first
+	if(cache_start >= 0){
+		details::cache_invalidate(filename, cache_start, cache_end - cache_start);
+		cache_start = cache_end = -1;
+	}
+}
+
+bool DBFS::File::sync()
+{
+	if(mapped.load(std::memory_order_acquire) && !msync()){
+		return false;
+	}
+	// Held so the descriptor is not evicted while syncing
+	auto lock = hold();
+	flush_stream();
+	int d = raw_fd();
+	if(fail() || d < 0){
+		return false;
+	}
+	#if defined(_WIN32)
+		int r = ::_commit(d);
+	#elif defined(__linux__)
+		int r = ::fdatasync(d);
+	#else
+		int r = ::fsync(d);
+	#endif
+	if(r != 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	return true;
+}
+
+bool DBFS::File::reserve(pos_t size)
+{
+	auto lock = hold();
+	int d = raw_fd();
+	if(d < 0){
+		return false;
+	}
+	int r = -1;
+	#if defined(__linux__)
+		// Blocks are allocated, size seen by readers stays the same
+		do{
+			r = ::fallocate(d, FALLOC_FL_KEEP_SIZE, 0, size);
+		}while(r != 0 && errno == EINTR);
+	#elif defined(F_PREALLOCATE)
+		fstore_t fs = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0};
+		r = ::fcntl(d, F_PREALLOCATE, &fs);
+		if(r == -1){
+			fs.fst_flags = F_ALLOCATEALL;
+			r = ::fcntl(d, F_PREALLOCATE, &fs);
+		}
+	#endif
+	if(r != 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	return true;
+}
+
+bool DBFS::File::truncate(pos_t size)
+{
+	unmap();
+	auto lock = hold();
+	flush_stream();
+	int d = raw_fd();
+	if(fail() || d < 0){
+		return false;
+	}
+	pos_t pos = st.tellp();
+	#ifdef _WIN32
+		int r = ::_chsize_s(d, size);
+	#else
+		int r = ::ftruncate(d, size);
+	#endif
+	// Seeking drops whatever the stream buffered from the old tail
+	st.seekp(pos);
+	p_updated = g_updated = false;
+	details::cache_drop(filename);
+	if(r != 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	return true;
+}
+
+bool DBFS::File::punch_hole(pos_t offset, pos_t size)
+{
+	auto lock = hold();
+	flush_stream();
+	int d = raw_fd();
+	if(fail() || d < 0){
+		return false;
+	}
+	int r = -1;
+	#if defined(__linux__)
+		do{
+			r = ::fallocate(d, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+		}while(r != 0 && errno == EINTR);
+	#elif defined(F_PUNCHHOLE)
+		fpunchhole_t ph = {0, 0, offset, size};
+		r = ::fcntl(d, F_PUNCHHOLE, &ph);
+	#else
+		errno = ENOTSUP;
+	#endif
+	st.seekp(st.tellp());
+	details::cache_invalidate(filename, offset, size);
+	if(r != 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	return true;
+}
+
+bool DBFS::File::advise(advice_t advice, pos_t offset, pos_t size)
+{
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	int d = raw_fd();
+	if(d < 0){
+		return false;
+	}
+	#if defined(__linux__)
+		if(advice == WILLNEED){
+			// readahead starts reading right away, fadvise only queues it
+			if(size == 0){
+				struct stat sb;
+				size = ::fstat(d, &sb) == 0 ? std::max((pos_t)sb.st_size - offset, (pos_t)0) : 0;
+			}
+			return ::readahead(d, offset, size) == 0;
+		}
+		const int advices[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+		return ::posix_fadvise(d, offset, size, advices[advice]) == 0;
+	#elif defined(__APPLE__)
+		switch(advice){
+			case SEQUENTIAL:
+			case NORMAL:
+				return ::fcntl(d, F_RDAHEAD, 1) != -1;
+			case RANDOM:
+				return ::fcntl(d, F_RDAHEAD, 0) != -1;
+			case WILLNEED:{
+				struct radvisory ra = {offset, (int)size};
+				return ::fcntl(d, F_RDADVISE, &ra) != -1;
+			}
+			default:
+				return false;
+		}
+	#elif !defined(_WIN32)
+		const int advices[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+		return ::posix_fadvise(d, offset, size, advices[advice]) == 0;
+	#else
+		return false;
+	#endif
+}
+
+void DBFS::File::set_scan(bool use)
+{
+	scan = use;
+	scan_pending = 0;
+	scan_done = 0;
+	advise(use ? SEQUENTIAL : NORMAL);
+}
+
+void DBFS::File::scan_drop(pos_t end)
+{
+	pos_t from = scan_done.load(std::memory_order_relaxed);
+	end -= end % 4096;
+	if(end < from){
+		// Reader went back, start over from there
+		scan_done.store(end, std::memory_order_relaxed);
+		return;
+	}
+	if(end - from < scan_window || !scan_done.compare_exchange_strong(from, end)){
+		return;
+	}
+	#if !defined(_WIN32) && !defined(__APPLE__)
+		int d = fd.load(std::memory_order_acquire);
+		if(d >= 0){
+			::posix_fadvise(d, from, end - from, POSIX_FADV_DONTNEED);
+		}
+	#endif
+}
+
+void DBFS::File::set_buffer_size(pos_t size)
+{
+	iobuf_size = size;
+}
+
+void DBFS::File::set_direct(bool use)
+{
+	std::unique_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::unique_lock<std::shared_mutex>(hmtx);
+	}
+	if(direct == use){
+		return;
+	}
+	direct = use;
+	// Open descriptor keeps its flags, the next positional call opens a new one
+	close_fd();
+	if(pooled){
+		details::pool_add(this);
+	}
+}
+
+bool DBFS::File::is_direct()
+{
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	return raw_fd() >= 0 && direct_fd;
+}
+
+bool DBFS::File::direct_ok(pos_t offset, const char* val, pos_t size)
+{
+	if(!direct || (offset % direct_align == 0 && size % direct_align == 0 && (uintptr_t)val % direct_align == 0)){
+		return true;
+	}
+	errno = EINVAL;
+	#ifdef DEBUG
+	SHOW_ERROR;
+	SHOW_FILENAME;
+	#endif
+	return false;
+}
+
 void DBFS::File::seekp(pos_t p)
 {
+	auto lock = hold();
 	st.seekp(p);
+	cache_pushed();
 	pos_p = p;
 	p_updated = true;
 }
 
 void DBFS::File::seekg(pos_t p)
 {
+	auto lock = hold();
 	if(g_updated && p == pos_g){
 		return;
 	}
@@ -101,10 +700,12 @@ void DBFS::File::seekg(pos_t p)
 	g_updated = true;
 	pos_g = p;
 	st.seekg(p);
+	cache_pushed();
 }
 
 DBFS::pos_t DBFS::File::tellp()
 {
+	auto lock = hold();
 	if(p_updated){
 		return pos_p;
 	}
@@ -114,6 +715,7 @@ DBFS::pos_t DBFS::File::tellp()
 
 DBFS::pos_t DBFS::File::tellg()
 {
+	auto lock = hold();
 	if(g_updated){
 		return pos_g;
 	}
@@ -123,11 +725,14 @@ DBFS::pos_t DBFS::File::tellg()
 
 DBFS::fstream& DBFS::File::stream()
 {
+	auto lock = hold();
 	return st;
 }
 
 void DBFS::File::read(char* val, pos_t size)
 {
+	DBFS_METRIC_START(metric, READ);
+	auto lock = hold();
 	#ifdef DEBUG
 	if(!is_open()){
 		SHOW_ERROR;
@@ -139,8 +744,25 @@ void DBFS::File::read(char* val, pos_t size)
 		assert(false);
 	}
 	#endif
-	st.read(val, size);
+	// Straight to the buffer, istream sentry and gcount bookkeeping are not
+	// needed for raw bytes
+	pos_t done = 0;
+	if(st.good()){
+		done = st.rdbuf()->sgetn(val, size);
+		cache_pushed();
+		if(done < size){
+			st.setstate(std::ios::eofbit | std::ios::failbit);
+		}
+	}
+	else{
+		st.setstate(std::ios::failbit);
+	}
 	pos_g += size;
+	if(scan.load(std::memory_order_relaxed) && (scan_pending += done) >= scan_window && !fail()){
+		scan_pending = 0;
+		raw_fd();
+		scan_drop(st.tellg());
+	}
 	#ifdef DEBUG
 	if(fail()){
 		SHOW_ERROR;
@@ -148,10 +770,13 @@ void DBFS::File::read(char* val, pos_t size)
 		assert(false);
 	}
 	#endif
+	DBFS_METRIC_DONE(metric, done, fail());
 }
 
 void DBFS::File::write(char* val, pos_t size)
 {
+	DBFS_METRIC_START(metric, WRITE);
+	auto lock = hold();
 	#ifdef DEBUG
 	if(fail()){
 		SHOW_ERROR;
@@ -159,8 +784,18 @@ void DBFS::File::write(char* val, pos_t size)
 		assert(false);
 	}
 	#endif
-	st.write(val, size);
+	pos_t from = cache_from();
+	if(!st.good()){
+		st.setstate(std::ios::failbit);
+	}
+	else if(st.rdbuf()->sputn(val, size) != size){
+		st.setstate(std::ios::badbit);
+	}
 	pos_p += size;
+	cache_dirty = true;
+	if(from >= 0){
+		cache_written(from, from + size);
+	}
 	#ifdef DEBUG
 	if(fail()){
 		SHOW_ERROR;
@@ -168,254 +803,1902 @@ void DBFS::File::write(char* val, pos_t size)
 		assert(false);
 	}
 	#endif
+	DBFS_METRIC_DONE(metric, size, fail());
 }
 
-DBFS::pos_t DBFS::File::size()
-{
-	st.seekp(0, st.end);
-	pos_p = st.tellp();
-	p_updated = true;
-	return pos_p;
-}
-
-bool DBFS::File::is_open()
+DBFS::pos_t DBFS::File::read_at(pos_t offset, char* val, pos_t size)
 {
-	return opened;
+	DBFS_METRIC_START(metric, READ);
+	if(mapped.load(std::memory_order_acquire)){
+		pos_t r = map_read(offset, val, size);
+		DBFS_METRIC_DONE(metric, r, false);
+		return r;
+	}
+	if(!direct_ok(offset, val, size)){
+		return -1;
+	}
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	int d = raw_fd();
+	if(d < 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return -1;
+	}
+	// Direct I/O is used to skip caching, the block cache would defeat it
+	bool cached = cache_block.load(std::memory_order_relaxed) > 0 && !direct;
+	pos_t done = cached ? read_cached(d, offset, val, size) : read_raw(d, offset, val, size);
+	if(done < 0){
+		return -1;
+	}
+	if(scan.load(std::memory_order_relaxed)){
+		scan_drop(offset + done);
+	}
+	DBFS_METRIC_DONE(metric, done, false);
+	return done;
 }
 
-bool DBFS::File::fail()
+DBFS::pos_t DBFS::File::read_raw(int d, pos_t offset, char* val, pos_t size)
 {
-	return st.fail();
+	pos_t done = 0;
+	while(done < size){
+		#ifdef _WIN32
+			::_lseeki64(d, offset + done, SEEK_SET);
+			int r = ::_read(d, val + done, size - done);
+		#else
+			ssize_t r = ::pread(d, val + done, size - done, offset + done);
+		#endif
+		if(r < 0 && errno == EINTR){
+			continue;
+		}
+		if(r < 0){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			SHOW_FILENAME;
+			#endif
+			return -1;
+		}
+		if(r == 0){
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+DBFS::pos_t DBFS::File::read_cached(int d, pos_t offset, char* val, pos_t size)
+{
+	pos_t block = cache_block.load(std::memory_order_relaxed);
+	if(block <= 0){
+		return read_raw(d, offset, val, size);
+	}
+	std::vector<char> buf;
+	pos_t done = 0;
+	while(done < size){
+		pos_t b = (offset + done) / block;
+		pos_t from = (offset + done) % block;
+		pos_t want = std::min(size - done, block - from);
+		pos_t r = details::cache_get(filename, b, from, val + done, want);
+		if(r < 0){
+			// Taken before the check, so a rename after it makes the put fail
+			unsigned long long renames;
+			unsigned long long epoch = details::cache_epoch(filename, renames);
+			if(!cache_valid(d, renames)){
+				pos_t n = read_raw(d, offset + done, val + done, size - done);
+				return n < 0 ? (done ? done : -1) : done + n;
+			}
+			// Whole block is read, neighbours of a hot value are usually hot too
+			buf.resize(block);
+			pos_t n = read_raw(d, b * block, buf.data(), block);
+			if(n < 0){
+				return done ? done : -1;
+			}
+			details::cache_put(filename, b, buf.data(), n, epoch);
+			r = std::max(std::min(n - from, want), (pos_t)0);
+			std::memcpy(val + done, buf.data() + from, r);
+		}
+		done += r;
+		if(r < want){
+			// Short block, end of file
+			break;
+		}
+	}
+	return done;
+}
+
+bool DBFS::File::cache_valid(int d, unsigned long long renames)
+{
+	if(renames == cache_seen.load(std::memory_order_acquire)){
+		return true;
+	}
+	#ifndef _WIN32
+		// Name could be moved over or removed since the descriptor was opened,
+		// its blocks must not come from the old file
+		struct stat a, b;
+		if(::fstat(d, &a) != 0 || ::stat(get_file_path(filename).c_str(), &b) != 0 || a.st_dev != b.st_dev || a.st_ino != b.st_ino){
+			return false;
+		}
+	#endif
+	cache_seen.store(renames, std::memory_order_release);
+	return true;
+}
+
+DBFS::pos_t DBFS::File::write_at(pos_t offset, const char* val, pos_t size)
+{
+	DBFS_METRIC_START(metric, WRITE);
+	if(mapped.load(std::memory_order_acquire)){
+		pos_t r = map_write(offset, val, size);
+		details::cache_invalidate(filename, offset, size);
+		DBFS_METRIC_DONE(metric, r, r < 0);
+		return r;
+	}
+	if(!direct_ok(offset, val, size)){
+		return -1;
+	}
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	int d = raw_fd();
+	if(d < 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return -1;
+	}
+	pos_t done = 0;
+	while(done < size){
+		#ifdef _WIN32
+			::_lseeki64(d, offset + done, SEEK_SET);
+			int r = ::_write(d, val + done, size - done);
+		#else
+			ssize_t r = ::pwrite(d, val + done, size - done, offset + done);
+		#endif
+		if(r < 0 && errno == EINTR){
+			continue;
+		}
+		if(r <= 0){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			SHOW_FILENAME;
+			#endif
+			details::cache_invalidate(filename, offset, done);
+			DBFS_METRIC_DONE(metric, done, !done);
+			return done ? done : -1;
+		}
+		done += r;
+	}
+	details::cache_invalidate(filename, offset, done);
+	DBFS_METRIC_DONE(metric, done, false);
+	return done;
+}
+
+DBFS::pos_t DBFS::File::readv(const iobufs& bufs)
+{
+	DBFS_METRIC_START(metric, READ);
+	auto lock = hold();
+	#ifdef DEBUG
+	if(fail()){
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		assert(false);
+	}
+	#endif
+	flush_stream();
+	pos_t pos = g_updated ? pos_g : (pos_t)st.tellg();
+	pos_t r = vector_io(raw_fd(), pos, bufs, false);
+	pos_g = pos + std::max(r, (pos_t)0);
+	g_updated = true;
+	st.seekg(pos_g);
+	DBFS_METRIC_DONE(metric, r, r < 0);
+	return r;
+}
+
+DBFS::pos_t DBFS::File::writev(const iobufs& bufs)
+{
+	DBFS_METRIC_START(metric, WRITE);
+	auto lock = hold();
+	#ifdef DEBUG
+	if(fail()){
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		assert(false);
+	}
+	#endif
+	flush_stream();
+	pos_t pos = p_updated ? pos_p : (pos_t)st.tellp();
+	pos_t r = vector_io(raw_fd(), pos, bufs, true);
+	details::cache_invalidate(filename, pos, std::max(r, (pos_t)0));
+	pos_p = pos + std::max(r, (pos_t)0);
+	p_updated = true;
+	st.seekp(pos_p);
+	DBFS_METRIC_DONE(metric, r, r < 0);
+	return r;
+}
+
+DBFS::pos_t DBFS::File::readv_at(pos_t offset, const iobufs& bufs)
+{
+	DBFS_METRIC_START(metric, READ);
+	if(mapped.load(std::memory_order_acquire)){
+		pos_t done = 0;
+		for(auto& it : bufs){
+			pos_t r = map_read(offset + done, it.data, it.size);
+			done += r;
+			if(r < it.size){
+				break;
+			}
+		}
+		DBFS_METRIC_DONE(metric, done, false);
+		return done;
+	}
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	pos_t r = vector_io(raw_fd(), offset, bufs, false);
+	DBFS_METRIC_DONE(metric, r, r < 0);
+	return r;
+}
+
+DBFS::pos_t DBFS::File::writev_at(pos_t offset, const iobufs& bufs)
+{
+	DBFS_METRIC_START(metric, WRITE);
+	if(mapped.load(std::memory_order_acquire)){
+		pos_t done = 0;
+		for(auto& it : bufs){
+			if(map_write(offset + done, it.data, it.size) < 0){
+				details::cache_invalidate(filename, offset, done);
+				DBFS_METRIC_DONE(metric, done, !done);
+				return done ? done : -1;
+			}
+			done += it.size;
+		}
+		details::cache_invalidate(filename, offset, done);
+		DBFS_METRIC_DONE(metric, done, false);
+		return done;
+	}
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	pos_t r = vector_io(raw_fd(), offset, bufs, true);
+	details::cache_invalidate(filename, offset, std::max(r, (pos_t)0));
+	DBFS_METRIC_DONE(metric, r, r < 0);
+	return r;
+}
+
+DBFS::pos_t DBFS::File::vector_io(int d, pos_t offset, const iobufs& bufs, bool write)
+{
+	if(d < 0){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return -1;
+	}
+	for(auto& it : bufs){
+		if(!direct_ok(offset, it.data, it.size)){
+			return -1;
+		}
+	}
+	pos_t done = 0;
+	#ifdef _WIN32
+		::_lseeki64(d, offset, SEEK_SET);
+		for(auto& it : bufs){
+			int r = write ? ::_write(d, it.data, it.size) : ::_read(d, it.data, it.size);
+			if(r < 0){
+				return done ? done : -1;
+			}
+			done += r;
+			if(r < it.size){
+				break;
+			}
+		}
+	#else
+		// `skip` is the part of bufs[i] transferred by a short call
+		size_t i = 0;
+		pos_t skip = 0;
+		while(i < bufs.size()){
+			struct iovec v[64];
+			int n = 0;
+			for(size_t j=i;j<bufs.size() && n<64;j++,n++){
+				v[n].iov_base = bufs[j].data + (j == i ? skip : 0);
+				v[n].iov_len = bufs[j].size - (j == i ? skip : 0);
+			}
+			ssize_t r = write ? ::pwritev(d, v, n, offset + done) : ::preadv(d, v, n, offset + done);
+			if(r < 0 && errno == EINTR){
+				continue;
+			}
+			if(r < 0){
+				#ifdef DEBUG
+				SHOW_ERROR;
+				SHOW_FILENAME;
+				#endif
+				return done ? done : -1;
+			}
+			if(r == 0){
+				break;
+			}
+			done += r;
+			while(i < bufs.size() && r >= bufs[i].size - skip){
+				r -= bufs[i].size - skip;
+				skip = 0;
+				i++;
+			}
+			skip += r;
+		}
+	#endif
+	return done;
+}
+
+bool DBFS::File::map(pos_t capacity)
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		std::unique_lock<std::shared_mutex> mlock(mmtx);
+		std::shared_lock<std::shared_mutex> lock;
+		if(max_open_files > 0){
+			lock = std::shared_lock<std::shared_mutex>(hmtx);
+		}
+		int d = raw_fd();
+		struct stat sb;
+		if(d < 0 || ::fstat(d, &sb) != 0){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			SHOW_FILENAME;
+			#endif
+			return false;
+		}
+		map_len = mapped ? std::max(map_len, (pos_t)sb.st_size) : sb.st_size;
+		if(!map_reserve(d, std::max(capacity, (pos_t)sb.st_size))){
+			return false;
+		}
+		mapped.store(true, std::memory_order_release);
+		return true;
+	#endif
+}
+
+void DBFS::File::unmap()
+{
+	std::unique_lock<std::shared_mutex> mlock(mmtx);
+	if(!mapped){
+		return;
+	}
+	#ifndef _WIN32
+		if(map_addr){
+			::munmap(map_addr, map_cap);
+		}
+	#endif
+	map_addr = nullptr;
+	map_cap = map_len = 0;
+	mapped.store(false, std::memory_order_release);
+}
+
+bool DBFS::File::is_mapped()
+{
+	return mapped.load(std::memory_order_acquire);
+}
+
+bool DBFS::File::msync(bool async)
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		std::shared_lock<std::shared_mutex> mlock(mmtx);
+		if(!mapped || !map_addr || !map_len){
+			return mapped;
+		}
+		if(::msync(map_addr, map_len, async ? MS_ASYNC : MS_SYNC) != 0){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			SHOW_FILENAME;
+			#endif
+			return false;
+		}
+		return true;
+	#endif
+}
+
+const char* DBFS::File::data()
+{
+	std::shared_lock<std::shared_mutex> mlock(mmtx);
+	return map_addr;
+}
+
+std::string_view DBFS::File::view(pos_t offset, pos_t size)
+{
+	std::shared_lock<std::shared_mutex> mlock(mmtx);
+	if(offset + size > map_len && mapped){
+		// The file might have grown through the stream, pick it up
+		mlock.unlock();
+		map_refresh();
+		mlock.lock();
+	}
+	if(!mapped || offset >= map_len){
+		return std::string_view();
+	}
+	return std::string_view(map_addr + offset, std::min(size, map_len - offset));
+}
+
+DBFS::pos_t DBFS::File::map_read(pos_t offset, char* val, pos_t size)
+{
+	// Copied under the lock, map_write may move the mapping with mremap
+	std::shared_lock<std::shared_mutex> mlock(mmtx);
+	if(offset + size > map_len && mapped){
+		mlock.unlock();
+		map_refresh();
+		mlock.lock();
+	}
+	if(!mapped || offset >= map_len){
+		return 0;
+	}
+	pos_t r = std::min(size, map_len - offset);
+	std::memcpy(val, map_addr + offset, r);
+	return r;
+}
+
+bool DBFS::File::map_reserve(int d, pos_t len)
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		if(len <= map_cap){
+			return true;
+		}
+		pos_t page = ::sysconf(_SC_PAGESIZE);
+		pos_t cap = std::max(len, map_cap * 2);
+		cap = (cap + page - 1) / page * page;
+		void* addr;
+		#ifdef MREMAP_MAYMOVE
+		if(map_addr){
+			addr = ::mremap(map_addr, map_cap, cap, MREMAP_MAYMOVE);
+		}
+		else
+		#endif
+		{
+			addr = ::mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, d, 0);
+			if(addr != MAP_FAILED && map_addr){
+				::munmap(map_addr, map_cap);
+			}
+		}
+		if(addr == MAP_FAILED){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			SHOW_FILENAME;
+			#endif
+			return false;
+		}
+		map_addr = (char*)addr;
+		map_cap = cap;
+		return true;
+	#endif
+}
+
+bool DBFS::File::map_refresh()
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		std::unique_lock<std::shared_mutex> mlock(mmtx);
+		std::shared_lock<std::shared_mutex> lock;
+		if(max_open_files > 0){
+			lock = std::shared_lock<std::shared_mutex>(hmtx);
+		}
+		int d = raw_fd();
+		struct stat sb;
+		if(!mapped || d < 0 || ::fstat(d, &sb) != 0){
+			return false;
+		}
+		if(sb.st_size <= map_len){
+			return true;
+		}
+		if(!map_reserve(d, sb.st_size)){
+			return false;
+		}
+		map_len = sb.st_size;
+		return true;
+	#endif
+}
+
+DBFS::pos_t DBFS::File::map_write(pos_t offset, const char* val, pos_t size)
+{
+	pos_t end = offset + size;
+	{
+		std::shared_lock<std::shared_mutex> mlock(mmtx);
+		if(end <= map_len){
+			std::memcpy(map_addr + offset, val, size);
+			return size;
+		}
+	}
+	#ifdef _WIN32
+		return -1;
+	#else
+		std::unique_lock<std::shared_mutex> mlock(mmtx);
+		if(end > map_len){
+			std::shared_lock<std::shared_mutex> lock;
+			if(max_open_files > 0){
+				lock = std::shared_lock<std::shared_mutex>(hmtx);
+			}
+			int d = raw_fd();
+			struct stat sb;
+			if(d < 0 || ::fstat(d, &sb) != 0){
+				#ifdef DEBUG
+				SHOW_ERROR;
+				SHOW_FILENAME;
+				#endif
+				return -1;
+			}
+			// `map_len` misses growth through the stream, the file is only
+			// ever extended here, never cut back to `end`
+			pos_t len = std::max(map_len, (pos_t)sb.st_size);
+			if(end > len && ::ftruncate(d, end) != 0){
+				#ifdef DEBUG
+				SHOW_ERROR;
+				SHOW_FILENAME;
+				#endif
+				return -1;
+			}
+			len = std::max(len, end);
+			if(!map_reserve(d, len)){
+				return -1;
+			}
+			map_len = len;
+		}
+		std::memcpy(map_addr + offset, val, size);
+		return size;
+	#endif
+}
+
+int DBFS::File::handle()
+{
+	std::shared_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::shared_lock<std::shared_mutex>(hmtx);
+	}
+	return raw_fd();
+}
+
+void DBFS::File::pin()
+{
+	pins.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void DBFS::File::unpin()
+{
+	pins.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+int DBFS::File::raw_fd()
+{
+	int d = fd.load(std::memory_order_acquire);
+	if(d >= 0 || !opened){
+		return d;
+	}
+	string filepath = DBFS::get_file_path(filename);
+	bool is_direct = false;
+	#ifdef _WIN32
+		d = ::_open(filepath.c_str(), _O_RDWR | _O_BINARY);
+	#else
+		#ifdef O_DIRECT
+			if(direct){
+				d = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+				is_direct = d >= 0;
+			}
+			// Not supported by the filesystem, fall back to the page cache
+			if(!direct || (d < 0 && errno == EINVAL)){
+				d = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC);
+			}
+		#else
+			d = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC);
+			#ifdef F_NOCACHE
+				is_direct = d >= 0 && direct && ::fcntl(d, F_NOCACHE, 1) == 0;
+			#endif
+		#endif
+	#endif
+	if(d < 0 && (errno == EMFILE || errno == ENFILE) && details::pool_evict(this)){
+		return raw_fd();
+	}
+	if(d < 0){
+		return d;
+	}
+	direct_fd = is_direct;
+	int expected = -1;
+	if(!fd.compare_exchange_strong(expected, d, std::memory_order_acq_rel)){
+		// Another reader opened it first
+		#ifdef _WIN32
+			::_close(d);
+		#else
+			::close(d);
+		#endif
+		return expected;
+	}
+	if(max_open_files > 0){
+		details::pool_add(this);
+	}
+	return d;
+}
+
+int DBFS::File::descriptors()
+{
+	return (!evicted && st.is_open() ? 1 : 0) + (fd.load(std::memory_order_acquire) >= 0 ? 1 : 0);
+}
+
+void DBFS::File::close_fd()
+{
+	int d = fd.exchange(-1);
+	if(d < 0){
+		return;
+	}
+	#ifdef _WIN32
+		::_close(d);
+	#else
+		::close(d);
+	#endif
+}
+
+DBFS::pos_t DBFS::File::size()
+{
+	auto lock = hold();
+	st.seekp(0, st.end);
+	pos_p = st.tellp();
+	p_updated = true;
+	return pos_p;
+}
+
+bool DBFS::File::is_open()
+{
+	return opened;
+}
+
+bool DBFS::File::fail()
+{
+	return st.fail();
+}
+
+void DBFS::File::close()
+{
+	if(!opened)
+		return;
+	unmap();
+	std::unique_lock<std::shared_mutex> lock;
+	if(max_open_files > 0){
+		lock = std::unique_lock<std::shared_mutex>(hmtx);
+	}
+	if(pooled){
+		details::pool_remove(this);
+	}
+	opened = false;
+	if(!evicted){
+		flush_stream();
+		st.close();
+	}
+	close_fd();
+	evicted = false;
+	if(lock.owns_lock()){
+		lock.unlock();
+	}
+	manifest::details::closed(filename);
+	for(auto& it : on_close_fns){
+		it(this);
+	}
+}
+
+DBFS::string DBFS::File::name()
+{
+	return filename;
+}
+
+bool DBFS::File::move(string newname)
+{
+	close();
+	bool r = DBFS::move(filename, newname);
+	if(!r){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		open();
+		return false;
+	}
+	filename = newname;
+	open();
+	return r;
+}
+
+bool DBFS::File::remove()
+{
+	close();
+	bool r = DBFS::remove(filename);
+	if(!r){
+		open();
+		return false;
+	}
+	filename = "";
+	return r;
+}
+
+bool DBFS::File::commit_as(string newname, bool sync)
+{
+	if(!opened || !(sync ? this->sync() : flush())){
+		return false;
+	}
+	#ifdef _WIN32
+		// Open files can not be renamed over on Windows
+		close();
+		bool r = DBFS::move(filename, newname);
+		if(r){
+			filename = newname;
+		}
+		open();
+	#else
+		// Descriptors follow the inode, the file stays open under the new name
+		bool r = DBFS::move(filename, newname);
+		if(r){
+			filename = newname;
+		}
+	#endif
+	if(!r){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		SHOW_FILENAME;
+		#endif
+		return false;
+	}
+	if(!sync){
+		return true;
+	}
+	string path;
+	get_file_path(newname, path);
+	return details::commit_wait(nullptr, path.substr(0, path.rfind('/')));
+}
+
+std::mutex& DBFS::File::get_mutex()
+{
+	return rmtx; 
+}
+
+std::lock_guard<std::mutex> DBFS::File::get_lock()
+{
+	return std::lock_guard<std::mutex>(get_mutex());
+}
+
+DBFS::rw_mutex& DBFS::File::get_rw_mutex()
+{
+	rw_mutex* m = rw.load(std::memory_order_acquire);
+	if(m){
+		return *m;
+	}
+	rw_mutex* created = new rw_mutex();
+	if(rw.compare_exchange_strong(m, created, std::memory_order_acq_rel)){
+		return *created;
+	}
+	delete created;
+	return *m;
+}
+
+std::shared_lock<DBFS::rw_mutex> DBFS::File::get_shared_lock()
+{
+	return std::shared_lock<rw_mutex>(get_rw_mutex());
+}
+
+std::unique_lock<DBFS::rw_mutex> DBFS::File::get_unique_lock()
+{
+	return std::unique_lock<rw_mutex>(get_rw_mutex());
+}
+
+void DBFS::File::on_close(file_hook_fn fn)
+{
+	on_close_fns.push_back(fn);
+}
+
+void DBFS::File::on_open(file_hook_fn fn)
+{
+	on_open_fns.push_back(fn);
+}
+
+DBFS::fstream DBFS::File::create_stream(string filename)
+{
+	string filepath = DBFS::get_file_path(filename);
+	std::lock_guard<std::mutex> lock(details::stripe(filename));
+	fstream s;
+	// Buffer has to be set before open to take effect
+	pos_t size = iobuf_size > 0 ? iobuf_size : buffer_size;
+	if(size > 0){
+		iobuf_data.resize(size);
+		s.rdbuf()->pubsetbuf(iobuf_data.data(), size);
+	}
+	if(created){
+		s.open(filepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+		return s;
+	}
+	// exists() may answer from a stale catalog, so a missing file is
+	// still created if the open fails
+	if(exists(filename)){
+		s.open(filepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+		if(s.is_open()){
+			return s;
+		}
+	}
+	if(details::create_file(filepath)){
+		details::track_create(filename);
+	}
+	s.open(filepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+	return s;
+}
+
+DBFS::pos_t DBFS::details::put_pending(std::streambuf* buf)
+{
+	// Put area pointers are protected, a pointer to member taken through a
+	// derived class reaches them on any streambuf
+	struct peek : std::streambuf{
+		static pos_t pending(std::streambuf* buf){
+			return (buf->*&peek::pptr)() - (buf->*&peek::pbase)();
+		}
+	};
+	return peek::pending(buf);
+}
+
+bool DBFS::details::create_file(const string& filepath)
+{
+	int trys = 3;
+	while(trys--){
+		create_path(filepath);
+		#ifdef _WIN32
+			int d = ::_open(filepath.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+		#else
+			int d = ::open(filepath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		#endif
+		if(d >= 0){
+			#ifdef _WIN32
+				::_close(d);
+			#else
+				::close(d);
+			#endif
+			return true;
+		}
+		// Parent directory could be removed by other stripe in between
+		if(errno != ENOENT){
+			break;
+		}
+		forget_path(filepath);
+	}
+	return false;
+}
+
+DBFS::string DBFS::get_file_path(string filename)
+{
+	string path;
+	get_file_path(filename, path);
+	return path;
+}
+
+void DBFS::get_file_path(const string& filename, string& path)
+{
+	details::build_path(filename, dir_levels, dir_width, path);
+}
+
+void DBFS::details::create_path(string filepath)
+{
+	int trys = 3;
+	while(trys--){
+		string curr = "";
+		bool created = true;
+		int filepath_size = filepath.size();
+		size_t leaf = filepath.rfind('/');
+		if(leaf == string::npos || dir_known(filepath.substr(0, leaf))){
+			return;
+		}
+		for(int i=0;i<filepath_size;i++){
+			if(filepath[i] == '/' && i > 0){
+				if(curr == "" || curr == "." || curr == ".." || dir_known(curr)){
+					curr.push_back(filepath[i]);
+					continue;
+				}
+				// Noted before mkdir, a thread that sees EEXIST right after it
+				// must still sync the parent. Old directories get one extra sync
+				dir_created(curr);
+				if(DBFS::details::mkdir(curr) == 0 || errno == EEXIST){
+					dir_add(curr);
+				}
+				else if(errno == ENOENT){
+					// Parent was removed after we created it, start over
+					forget_path(curr);
+					created = false;
+					break;
+				}
+			}
+			curr.push_back(filepath[i]);
+		}
+		if(created){
+			return;
+		}
+	}
+}
+
+void DBFS::details::remove_path(string path)
+{
+	// Caller holds the stripe lock of `path`. stop_reaper turns the reaper
+	// off before it takes stripe locks, so nothing is queued after its sweep
+	if(reaper_on.load(std::memory_order_relaxed)){
+		// Leaf directory only, parents are tried by the reaper once it is gone
+		size_t leaf = path.rfind('/');
+		if(leaf != string::npos && leaf > root.size()){
+			string dir = path.substr(0, leaf + 1);
+			if(reaper_dirs[dir_stripe(dir)].insert(dir).second){
+				reaper_pending++;
+			}
+		}
+		return;
+	}
+	remove_dirs(path);
+}
+
+void DBFS::details::remove_dirs(string path)
+{
+	char c = '\0';
+	while(path != root){
+		if(c == '/' && DBFS::details::rmdir(path.c_str()) == 0){
+			dir_forget(path);
+		}
+		c = path.back();
+		path.pop_back();
+	}
+}
+
+bool DBFS::details::dir_known(const string& path)
+{
+	size_t h = std::hash<string>()(path) % dir_cache_shards;
+	std::shared_lock<std::shared_mutex> lock(dir_cache_mtx[h]);
+	return dir_cache[h].count(path);
+}
+
+void DBFS::details::dir_add(const string& path)
+{
+	size_t h = std::hash<string>()(path) % dir_cache_shards;
+	std::lock_guard<std::shared_mutex> lock(dir_cache_mtx[h]);
+	if(dir_cache[h].size() >= dir_cache_limit){
+		dir_cache[h].clear();
+	}
+	dir_cache[h].insert(path);
+}
+
+void DBFS::details::dir_forget(const string& path)
+{
+	size_t h = std::hash<string>()(path) % dir_cache_shards;
+	std::lock_guard<std::shared_mutex> lock(dir_cache_mtx[h]);
+	dir_cache[h].erase(path);
+}
+
+void DBFS::details::forget_path(const string& filepath)
+{
+	// Every directory of the path, the file name itself is never cached
+	for(size_t i=filepath.find('/', 1);i!=string::npos;i=filepath.find('/', i + 1)){
+		dir_forget(filepath.substr(0, i));
+	}
+}
+
+uint32_t DBFS::details::crc32(const char* data, size_t size)
+{
+	static const auto table = [](){
+		std::vector<uint32_t> t(256);
+		for(uint32_t i=0;i<256;i++){
+			uint32_t c = i;
+			for(int k=0;k<8;k++){
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			t[i] = c;
+		}
+		return t;
+	}();
+	uint32_t crc = 0xFFFFFFFFu;
+	for(size_t i=0;i<size;i++){
+		crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFu;
+}
+
+std::mutex& DBFS::details::stripe(string filename)
+{
+	return mtxs[stripe_index(filename)];
+}
+
+size_t DBFS::details::stripe_index(const string& filename)
+{
+	// Files of the same leaf directory share the stripe, so creating a file
+	// and removing its leaf directory never run at the same time
+	unsigned int h = 0;
+	int len = dir_levels * dir_width;
+	for(int i=0;i<len && i<(int)filename.size();i++){
+		h = h * 131 + (unsigned char)filename[i];
+	}
+	return h % (36*36);
+}
+
+size_t DBFS::details::dir_stripe(const string& dir)
+{
+	// Leaf directory path without root and slashes is the stripe key of its files
+	string key;
+	for(size_t i=root.size()+1;i<dir.size();i++){
+		if(dir[i] != '/'){
+			key.push_back(dir[i]);
+		}
+	}
+	return stripe_index(key);
+}
+
+void DBFS::details::pool_add(File* file)
+{
+	std::lock_guard<std::mutex> lock(pool_mtx);
+	file->pool_ref.store(true, std::memory_order_relaxed);
+	if(!file->pooled){
+		file->pool_it = pool.insert(pool.end(), file);
+		file->pooled = true;
+	}
+	int held = file->descriptors();
+	pool_fds += held - file->pool_held;
+	file->pool_held = held;
+	while(pool_fds > max_open_files){
+		if(!evict_one(file)){
+			break;
+		}
+	}
+}
+
+void DBFS::details::pool_remove(File* file)
+{
+	std::lock_guard<std::mutex> lock(pool_mtx);
+	if(!file->pooled){
+		return;
+	}
+	pool.erase(file->pool_it);
+	file->pooled = false;
+	pool_fds -= file->pool_held;
+	file->pool_held = 0;
+}
+
+bool DBFS::details::pool_evict(File* except)
+{
+	std::lock_guard<std::mutex> lock(pool_mtx);
+	return evict_one(except);
+}
+
+bool DBFS::details::evict_one(File* except)
+{
+	// Second chance sweep: recently touched files are moved to the back
+	// once, files that are busy right now are skipped
+	int checks = pool.size() * 2;
+	while(checks-- > 0 && !pool.empty()){
+		File* file = pool.front();
+		pool.splice(pool.end(), pool, pool.begin());
+		if(file == except){
+			continue;
+		}
+		if(file->pool_ref.exchange(false, std::memory_order_relaxed)){
+			continue;
+		}
+		if(!file->hmtx.try_lock()){
+			continue;
+		}
+		if(file->pins.load(std::memory_order_acquire) > 0){
+			file->hmtx.unlock();
+			continue;
+		}
+		file->evict();
+		pool.erase(file->pool_it);
+		file->pooled = false;
+		pool_fds -= file->pool_held;
+		file->pool_held = 0;
+		file->hmtx.unlock();
+		return true;
+	}
+	return false;
+}
+
+int DBFS::details::iobuf_class(pos_t size)
+{
+	int c = 0;
+	while(((pos_t)1 << c) < std::max(size, direct_align) && c < iobuf_classes - 1){
+		c++;
+	}
+	return c;
+}
+
+char* DBFS::details::iobuf_alloc(pos_t size)
+{
+	#ifdef _WIN32
+		return (char*)::_aligned_malloc(size, direct_align);
+	#else
+		if(size < iobuf_huge){
+			void* data = nullptr;
+			return ::posix_memalign(&data, direct_align, size) == 0 ? (char*)data : nullptr;
+		}
+		void* data = MAP_FAILED;
+		#ifdef MAP_HUGETLB
+			if(huge_pages){
+				data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			}
+		#endif
+		// No reserved huge pages, let transparent huge pages back it if possible
+		if(data == MAP_FAILED){
+			data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			#ifdef MADV_HUGEPAGE
+				if(data != MAP_FAILED && huge_pages){
+					::madvise(data, size, MADV_HUGEPAGE);
+				}
+			#endif
+		}
+		return data == MAP_FAILED ? nullptr : (char*)data;
+	#endif
+}
+
+void DBFS::details::iobuf_release(char* data, pos_t size)
+{
+	#ifdef _WIN32
+		::_aligned_free(data);
+	#else
+		if(size < iobuf_huge){
+			::free(data);
+		}
+		else{
+			::munmap(data, size);
+		}
+	#endif
+}
+
+int DBFS::details::mkdir(string path)
+{
+	int err = 0;
+	#if defined(_WIN32)
+		err = ::_mkdir(path.c_str()); // can be used on Windows
+	#else 
+		mode_t mode = 0733; // UNIX style permissions
+		err = ::mkdir(path.c_str(),mode); // can be used on non-Windows
+	#endif
+	return err;
+}
+
+int DBFS::details::rmdir(string path)
+{
+	int err = 0;
+	#if defined(_WIN32)
+		err = ::_rmdir(path.c_str()); // can be used on Windows
+	#else 
+		err = ::rmdir(path.c_str()); // can be used on non-Windows
+	#endif
+	return err;
+}
+
+bool DBFS::exists(string filename)
+{
+	DBFS_METRIC_START(metric, EXISTS);
+	DBFS_METRIC_DONE(metric, 0, false);
+	if(catalog_state.load(std::memory_order_relaxed) == 2){
+		return details::catalog_has(filename);
+	}
+	#if defined(_WIN32)
+		return ::_access(get_file_path(filename).c_str(), 0) == 0;
+	#else
+		return ::access(get_file_path(filename).c_str(), F_OK) == 0;
+	#endif
+}
+
+bool DBFS::move(string oldname, string newname)
+{
+	DBFS_METRIC_START(metric, MOVE);
+	std::mutex* m1 = &details::stripe(oldname);
+	std::mutex* m2 = &details::stripe(newname);
+	if(m1 > m2){
+		std::swap(m1, m2);
+	}
+	std::unique_lock<std::mutex> lock1(*m1);
+	std::unique_lock<std::mutex> lock2;
+	if(m1 != m2){
+		lock2 = std::unique_lock<std::mutex>(*m2);
+	}
+	
+	string oldpath = get_file_path(oldname);
+	string newpath = get_file_path(newname);
+	int r = -1;
+	int trys = 3;
+	while(trys--){
+		DBFS::details::create_path(newpath);
+		r = std::rename(oldpath.c_str(), newpath.c_str());
+		if(r == 0 || errno != ENOENT || !exists(oldname)){
+			break;
+		}
+		DBFS::details::forget_path(newpath);
+	}
+	#ifdef DEBUG
+	if(r != 0){
+		SHOW_ERROR;
+	}
+	#endif
+	if(r == 0){
+		details::track_move(oldname, newname);
+	}
+	// Directory of `newpath` is not empty, nothing to remove when it is the same
+	if(r != 0 || oldpath.compare(0, oldpath.rfind('/'), newpath, 0, newpath.rfind('/')) != 0){
+		DBFS::details::remove_path(oldpath);
+	}
+	DBFS_METRIC_DONE(metric, 0, r != 0);
+	
+	return !r;
+}
+
+bool DBFS::remove(string filename, bool rem_path)
+{
+	DBFS_METRIC_START(metric, REMOVE);
+	string path = get_file_path(filename);
+	std::lock_guard<std::mutex> lock(details::stripe(filename));
+	int r = std::remove(path.c_str());
+	DBFS_METRIC_DONE(metric, 0, r != 0);
+	if(r == 0){
+		details::track_remove(filename);
+	}
+	
+	#ifdef DEBUG
+	if(r != 0){
+		// Do not show error as it is possible and legal scenario
+		//SHOW_ERROR; 
+	}
+	#endif
+	
+	if(!rem_path){
+		return !r;
+	}
+	
+	DBFS::details::remove_path(path);
+	
+	return !r;
+}
+
+DBFS::File* DBFS::create()
+{
+	DBFS_METRIC_START(metric, CREATE);
+	File* file = new File();
+	details::open_new(file);
+	DBFS_METRIC_DONE(metric, 0, !file->is_open());
+	return file;
+}
+
+DBFS::File* DBFS::create(file_hook_fn onopen, file_hook_fn onclose)
+{
+	DBFS_METRIC_START(metric, CREATE);
+	File* file = new File();
+	file->on_open(onopen);
+	file->on_close(onclose);
+	details::open_new(file);
+	DBFS_METRIC_DONE(metric, 0, !file->is_open());
+	return file;
+}
+
+bool DBFS::details::open_new(File* file)
+{
+	// Generated names are unique only within this process, the O_EXCL
+	// create tells when another one sharing the root has taken the name
+	string filename;
+	bool made = false;
+	int trys = 16;
+	while(!made && trys--){
+		filename = random_filename();
+		std::lock_guard<std::mutex> lock(stripe(filename));
+		made = create_file(get_file_path(filename));
+		if(made){
+			track_create(filename);
+		}
+		else if(errno != EEXIST){
+			break;
+		}
+	}
+	if(!made){
+		#ifdef DEBUG
+		SHOW_ERROR;
+		#endif
+		file->filename = filename;
+		file->st.setstate(std::ios_base::failbit);
+		return false;
+	}
+	file->created = true;
+	bool r = file->open(filename);
+	file->created = false;
+	return r;
+}
+
+DBFS::File* DBFS::create(string filename)
+{
+	DBFS_METRIC_START(metric, CREATE);
+	File* file = new File(filename);
+	DBFS_METRIC_DONE(metric, 0, !file->is_open());
+	return file;
+}
+
+DBFS::string DBFS::random_filename()
+{
+	thread_local std::mt19937_64 rnd_gen = details::seed_random();
+	thread_local unsigned long long seq = 0, seq_end = 0;
+	
+	if(seq == seq_end){
+		seq = name_seq.fetch_add(name_seq_block, std::memory_order_relaxed);
+		seq_end = seq + name_seq_block;
+	}
+	
+	// Random head keeps directory fan-out even, one 64 bit draw gives 12 chars
+	string ret = "";
+	ret.reserve(filelength + 20);
+	unsigned long long rnd = 0;
+	for(int i=0;i<filelength;i++){
+		if(i % 12 == 0){
+			rnd = rnd_gen();
+		}
+		ret.push_back(details::base36(rnd % 36));
+		rnd /= 36;
+	}
+	
+	// Length prefixed sequence number, so names never collide in this process
+	char digits[16];
+	int len = 0;
+	unsigned long long n = seq++;
+	do{
+		digits[len++] = details::base36(n % 36);
+		n /= 36;
+	}while(n > 0);
+	ret.push_back(details::base36(len));
+	ret.append(digits, len);
+	
+	if(suffix_minutex){
+		unsigned int ctime = time(NULL)/60;
+		while(ctime > 0){
+			ret.push_back(details::base36(ctime % 36));
+			ctime /= 36;
+		}
+	}
+	
+	return ret;
+}
+
+std::mt19937_64 DBFS::details::seed_random()
+{
+	std::random_device rd;
+	std::seed_seq seq{
+		(unsigned int)rd(),
+		(unsigned int)rd(),
+		(unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()),
+		(unsigned int)std::chrono::high_resolution_clock::now().time_since_epoch().count()
+	};
+	return std::mt19937_64(seq);
+}
+
+char DBFS::details::base36(int val)
+{
+	return val < 10 ? val+'0' : val-10+'a';
+}
+
+void DBFS::details::build_path(const string& filename, int levels, int width, string& path)
+{
+	// Single allocation at most, none if `path` has enough capacity already
+	path.clear();
+	path.reserve(root.size() + levels * (width + 1) + prefix.size() + filename.size() + suffix.size() + 1);
+	path.append(root);
+	int size = filename.size();
+	for(int i=0;i<levels;i++){
+		path.push_back('/');
+		int from = std::min(i * width, size);
+		path.append(filename, from, std::min(width, size - from));
+	}
+	path.push_back('/');
+	path.append(prefix);
+	path.append(filename);
+	path.append(suffix);
+}
+
+long DBFS::reshard(int old_levels, int old_width, int threads)
+{
+	std::atomic<long> moved{0};
+	bool ok = details::for_each_leaf(old_levels, threads, [&](const string& dir, const std::vector<string>& files){
+		string filename, path;
+		for(auto& it : files){
+			if(!details::strip_name(it.substr(dir.size() + 1), filename)){
+				continue;
+			}
+			details::build_path(filename, old_levels, old_width, path);
+			if(path != it){
+				// Not placed by the old layout, leave it alone
+				continue;
+			}
+			get_file_path(filename, path);
+			if(path == it){
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(details::stripe(filename));
+			details::create_path(path);
+			if(std::rename(it.c_str(), path.c_str()) == 0){
+				moved++;
+			}
+		}
+		std::lock_guard<std::mutex> lock(mtxs[details::dir_stripe(dir + "/")]);
+		details::remove_path(dir + "/");
+	});
+	return ok ? (long)moved : -1;
+}
+
+bool DBFS::details::for_each_leaf(int levels, int threads, const leaf_fn& fn)
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		// First level directories are shared between threads
+		std::vector<string> tops;
+		if(levels > 0){
+			list_dir(root, tops, true);
+		}
+		else{
+			tops.push_back(root);
+		}
+		
+		std::atomic<size_t> next{0};
+		std::vector<std::thread> v;
+		for(int t=0;t<std::max(threads, 1);t++){
+			v.emplace_back([&](){
+				size_t i;
+				while((i = next.fetch_add(1)) < tops.size()){
+					walk_dir(tops[i], levels > 0 ? 1 : 0, levels, fn);
+				}
+			});
+		}
+		for(auto& it : v){
+			it.join();
+		}
+		return true;
+	#endif
+}
+
+void DBFS::details::walk_dir(string dir, int depth, int levels, const leaf_fn& fn)
+{
+	std::vector<string> entries;
+	// Directories above the leaf level, files at the leaf level. Anything else
+	// does not belong to the layout
+	list_dir(dir, entries, depth < levels);
+	if(depth < levels){
+		for(auto& it : entries){
+			walk_dir(it, depth + 1, levels, fn);
+		}
+		return;
+	}
+	fn(dir, entries);
+}
+
+bool DBFS::details::strip_name(const string& base, string& filename)
+{
+	if(base.size() < prefix.size() + suffix.size() || base.compare(0, prefix.size(), prefix) != 0 || base.compare(base.size() - suffix.size(), suffix.size(), suffix) != 0){
+		return false;
+	}
+	filename.assign(base, prefix.size(), base.size() - prefix.size() - suffix.size());
+	return true;
+}
+
+void DBFS::details::list_dir(string dir, std::vector<string>& entries, bool dirs)
+{
+	#if defined(__linux__)
+		// getdents64 fills the buffer with many entries per syscall
+		int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(fd < 0){
+			return;
+		}
+		char buf[32768];
+		long n;
+		while((n = ::syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+			for(long pos=0;pos<n;){
+				struct dirent64* e = (struct dirent64*)(buf + pos);
+				pos += e->d_reclen;
+				list_entry(dir, e->d_name, e->d_type, entries, dirs);
+			}
+		}
+		::close(fd);
+	#elif !defined(_WIN32)
+		DIR* d = ::opendir(dir.c_str());
+		if(!d){
+			return;
+		}
+		while(struct dirent* e = ::readdir(d)){
+			list_entry(dir, e->d_name, e->d_type, entries, dirs);
+		}
+		::closedir(d);
+	#endif
+}
+
+void DBFS::details::list_entry(const string& dir, const char* name, unsigned char type, std::vector<string>& entries, bool dirs)
+{
+	#ifndef _WIN32
+		// Generated names never start with a dot, such entries are DBFS own
+		// files like the manifest, or `.` and `..`
+		if(name[0] == '.'){
+			return;
+		}
+		string path = dir + "/" + name;
+		bool is_dir = type == DT_DIR;
+		if(type == DT_UNKNOWN){
+			struct stat sb;
+			is_dir = ::lstat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode);
+		}
+		else if(type != DT_DIR && type != DT_REG){
+			return;
+		}
+		if(is_dir == dirs){
+			entries.push_back(std::move(path));
+		}
+	#endif
+}
+
+bool DBFS::load_catalog(int threads)
+{
+	// Track changes during the scan, answer exists() only once it is complete
+	drop_catalog();
+	catalog_state = 1;
+	if(manifest::is_open()){
+		for(auto& it : manifest::list()){
+			details::catalog_scanned(it.name);
+		}
+		details::catalog_loaded();
+		return true;
+	}
+	bool ok = details::for_each_leaf(dir_levels, threads, [](const string& dir, const std::vector<string>& files){
+		string filename;
+		for(auto& it : files){
+			if(details::strip_name(it.substr(dir.size() + 1), filename)){
+				details::catalog_scanned(filename);
+			}
+		}
+	});
+	if(!ok){
+		drop_catalog();
+		return false;
+	}
+	details::catalog_loaded();
+	return true;
 }
 
-void DBFS::File::close()
+void DBFS::drop_catalog()
 {
-	if(!opened)
-		return;
-	opened = false;
-	st.close();
-	for(auto& it : on_close_fns){
-		it(this);
+	catalog_state = 0;
+	for(int i=0;i<catalog_shards;i++){
+		std::lock_guard<std::shared_mutex> lock(catalog_mtx[i]);
+		catalog[i].clear();
+		catalog_removed[i].clear();
 	}
 }
 
-DBFS::string DBFS::File::name()
+size_t DBFS::catalog_size()
 {
-	return filename;
+	size_t size = 0;
+	for(int i=0;i<catalog_shards;i++){
+		std::shared_lock<std::shared_mutex> lock(catalog_mtx[i]);
+		size += catalog[i].size();
+	}
+	return size;
 }
 
-bool DBFS::File::move(string newname)
+void DBFS::details::track_create(const string& filename)
 {
-	close();
-	bool r = DBFS::move(filename, newname);
-	if(!r){
-		#ifdef DEBUG
-		SHOW_ERROR;
-		SHOW_FILENAME;
-		#endif
-		open();
-		return false;
-	}
-	filename = newname;
-	open();
-	return r;
+	catalog_add(filename);
+	manifest::details::created(filename);
 }
 
-bool DBFS::File::remove()
+void DBFS::details::track_move(const string& oldname, const string& newname)
 {
-	close();
-	bool r = DBFS::remove(filename);
-	if(!r){
-		open();
-		return false;
-	}
-	filename = "";
-	return r;
+	cache_unlink(oldname);
+	cache_unlink(newname);
+	catalog_erase(oldname);
+	catalog_add(newname);
+	manifest::details::moved(oldname, newname);
 }
 
-std::mutex& DBFS::File::get_mutex()
+void DBFS::details::track_remove(const string& filename)
 {
-	return rmtx; 
+	cache_unlink(filename);
+	catalog_erase(filename);
+	manifest::details::removed(filename);
 }
 
-std::lock_guard<std::mutex> DBFS::File::get_lock()
+bool DBFS::details::catalog_has(const string& filename)
 {
-	return std::lock_guard<std::mutex>(get_mutex());
+	size_t h = std::hash<string>()(filename) % catalog_shards;
+	std::shared_lock<std::shared_mutex> lock(catalog_mtx[h]);
+	return catalog[h].count(filename);
 }
 
-void DBFS::File::on_close(file_hook_fn fn)
+void DBFS::details::catalog_add(const string& filename)
 {
-	on_close_fns.push_back(fn);
+	if(catalog_state.load(std::memory_order_relaxed) == 0){
+		return;
+	}
+	size_t h = std::hash<string>()(filename) % catalog_shards;
+	std::lock_guard<std::shared_mutex> lock(catalog_mtx[h]);
+	catalog[h].insert(filename);
+	catalog_removed[h].erase(filename);
 }
 
-void DBFS::File::on_open(file_hook_fn fn)
+void DBFS::details::catalog_scanned(const string& filename)
 {
-	on_open_fns.push_back(fn);
+	size_t h = std::hash<string>()(filename) % catalog_shards;
+	std::lock_guard<std::shared_mutex> lock(catalog_mtx[h]);
+	if(!catalog_removed[h].count(filename)){
+		catalog[h].insert(filename);
+	}
 }
 
-DBFS::fstream DBFS::File::create_stream(string filename)
+void DBFS::details::catalog_loaded()
 {
-	string filepath = DBFS::get_file_path(filename);
-	std::lock_guard<std::mutex> lock(mtx);
-	if(!exists(filename)){
-		details::create_path(filepath);
-		std::ofstream f(filepath);
+	for(int i=0;i<catalog_shards;i++){
+		std::lock_guard<std::shared_mutex> lock(catalog_mtx[i]);
+		for(auto& it : catalog_removed[i]){
+			catalog[i].erase(it);
+		}
+		catalog_removed[i].clear();
 	}
-	return fstream(filepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+	catalog_state = 2;
 }
 
-DBFS::string DBFS::get_file_path(string filename)
+void DBFS::details::catalog_erase(const string& filename)
 {
-	string f1 = filename.substr(0,2);
-	string f2 = filename.substr(2,2);
-	return root + "/" + f1 + "/" + f2 + "/" + prefix + filename + suffix;
+	if(catalog_state.load(std::memory_order_relaxed) == 0){
+		return;
+	}
+	size_t h = std::hash<string>()(filename) % catalog_shards;
+	std::lock_guard<std::shared_mutex> lock(catalog_mtx[h]);
+	catalog[h].erase(filename);
+	if(catalog_state.load(std::memory_order_relaxed) == 1){
+		catalog_removed[h].insert(filename);
+	}
 }
 
-void DBFS::details::create_path(string filepath)
+void DBFS::start_reaper(int rate)
 {
-	string curr = "";
-	int filepath_size = filepath.size();
-	for(int i=0;i<filepath_size;i++){
-		if(filepath[i] == '/' && i > 0){
-			if(curr == "" || curr == "." || curr == ".."){
-				curr.push_back(filepath[i]);
-				continue;
-			}
-			DBFS::details::mkdir(curr);
-		}
-		curr.push_back(filepath[i]);
+	std::lock_guard<std::mutex> lock(reaper_mtx);
+	reaper_rate = std::max(rate, 1);
+	if(reaper_on){
+		return;
 	}
+	reaper_stop = false;
+	reaper = std::thread(details::reaper_loop);
+	reaper_on = true;
 }
 
-void DBFS::details::remove_path(string path)
+void DBFS::stop_reaper()
 {
-	char c = '\0';
-	while(path != root){
-		if(c == '/'){
-			DBFS::details::rmdir(path.c_str());
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> lock(reaper_mtx);
+		if(!reaper_on){
+			return;
 		}
-		c = path.back();
-		path.pop_back();
+		reaper_on = false;
+		reaper_stop = true;
+		t = std::move(reaper);
+	}
+	reaper_cv.notify_all();
+	t.join();
+	
+	// Whatever is left is removed right away
+	for(int i=0;i<36*36 && reaper_pending > 0;i++){
+		std::lock_guard<std::mutex> lock(mtxs[i]);
+		for(auto& it : reaper_dirs[i]){
+			details::remove_dirs(it);
+		}
+		reaper_pending -= reaper_dirs[i].size();
+		reaper_dirs[i].clear();
 	}
 }
 
-int DBFS::details::mkdir(string path)
+bool DBFS::sync_dir(string filename)
 {
-	int err = 0;
-	#if defined(_WIN32)
-		err = ::_mkdir(path.c_str()); // can be used on Windows
-	#else 
-		mode_t mode = 0733; // UNIX style permissions
-		err = ::mkdir(path.c_str(),mode); // can be used on non-Windows
-	#endif
-	return err;
+	string path;
+	get_file_path(filename, path);
+	return details::sync_path(path.substr(0, path.rfind('/')));
 }
 
-int DBFS::details::rmdir(string path)
+void DBFS::start_group_commit(int window_us)
 {
-	int err = 0;
-	#if defined(_WIN32)
-		err = ::_rmdir(path.c_str()); // can be used on Windows
-	#else 
-		err = ::rmdir(path.c_str()); // can be used on non-Windows
-	#endif
-	return err;
+	std::lock_guard<std::mutex> lock(commit_mtx);
+	commit_window = std::max(window_us, 0);
+	if(commit_on){
+		return;
+	}
+	commit_stop = false;
+	committer = std::thread(details::commit_loop);
+	commit_on = true;
 }
 
-bool DBFS::exists(string filename)
+void DBFS::stop_group_commit()
 {
-	if(FILE *file = fopen(get_file_path(filename).c_str(), "r")){
-		fclose(file);
-		return true;
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> lock(commit_mtx);
+		if(!commit_on){
+			return;
+		}
+		commit_on = false;
+		commit_stop = true;
+		t = std::move(committer);
 	}
-	return false;
+	// Pending batch is still synced before the thread exits
+	commit_cv.notify_all();
+	t.join();
 }
 
-bool DBFS::move(string oldname, string newname)
+bool DBFS::commit(File* file)
 {
-	mtx.lock();
-	DBFS::details::create_path(get_file_path(newname));
-	int r = std::rename(get_file_path(oldname).c_str(), get_file_path(newname).c_str());
-	#ifdef DEBUG
-	if(r != 0){
-		SHOW_ERROR;
+	string path;
+	get_file_path(file->name(), path);
+	return details::commit_wait(file, path.substr(0, path.rfind('/')));
+}
+
+bool DBFS::replace_atomic(string filename, const file_writer_fn& writer, bool sync)
+{
+	// Temporary name shares the leaf directory with `filename`, so the rename
+	// touches a single directory. Unique part of generated names is the tail
+	string tmpname = random_filename();
+	size_t key = std::min({(size_t)(dir_levels * dir_width), filename.size(), tmpname.size()});
+	tmpname.replace(0, key, filename, 0, key);
+	File f(tmpname);
+	if(f.is_open() && writer(f) && f.commit_as(filename, sync)){
+		return true;
 	}
-	#endif
-	DBFS::details::remove_path(get_file_path(oldname));
-	mtx.unlock();
-	
-	return !r;
+	if(f.name() == tmpname){
+		f.remove();
+	}
+	return false;
 }
 
-bool DBFS::remove(string filename, bool rem_path)
+bool DBFS::details::commit_wait(File* file, const string& dir)
 {
-	string path = get_file_path(filename);
-	mtx.lock();
-	int r = std::remove(path.c_str());
-	
-	#ifdef DEBUG
-	if(r != 0){
-		// Do not show error as it is possible and legal scenario
-		//SHOW_ERROR; 
+	std::unique_lock<std::mutex> lock(commit_mtx);
+	if(!commit_on){
+		lock.unlock();
+		return (!file || file->sync()) && sync_path(dir);
 	}
-	#endif
-	
-	if(!rem_path){
-		mtx.unlock();
-		return !r;
+	if(!commit_next){
+		commit_next = std::make_shared<commit_batch>();
 	}
-		
-	DBFS::details::remove_path(path);
-	mtx.unlock();
-	
-	return !r;
+	auto batch = commit_next;
+	// Directory only requests have no file result, they share the batch one
+	bool* ok = file ? &batch->files.emplace(file, false).first->second : &batch->dirs_ok;
+	batch->dirs.insert(dir);
+	commit_cv.notify_all();
+	commit_cv.wait(lock, [&batch](){ return batch->done; });
+	return *ok;
 }
 
-DBFS::File* DBFS::create()
+void DBFS::details::commit_loop()
 {
-	string filename;
-	do{
-		filename = DBFS::random_filename();
-	}while(DBFS::exists(filename));
-	return create(filename);
+	std::unique_lock<std::mutex> lock(commit_mtx);
+	while(true){
+		commit_cv.wait(lock, [](){ return commit_next || commit_stop; });
+		if(!commit_next){
+			break;
+		}
+		// Gives other writers the window to join the batch
+		if(!commit_stop && commit_window > 0){
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::microseconds(commit_window));
+			lock.lock();
+		}
+		auto batch = std::move(commit_next);
+		commit_next.reset();
+		lock.unlock();
+		
+		bool dirs_ok = true;
+		for(auto& it : batch->files){
+			it.second = it.first->sync();
+		}
+		for(auto& it : batch->dirs){
+			dirs_ok = sync_path(it) && dirs_ok;
+		}
+		
+		lock.lock();
+		for(auto& it : batch->files){
+			it.second = it.second && dirs_ok;
+		}
+		batch->dirs_ok = dirs_ok;
+		batch->done = true;
+		commit_cv.notify_all();
+	}
 }
 
-DBFS::File* DBFS::create(file_hook_fn onopen, file_hook_fn onclose)
+bool DBFS::details::sync_path(const string& dir)
 {
-	string filename;
-	do{
-		filename = DBFS::random_filename();
-	}while(DBFS::exists(filename));
-	return new File(filename, onopen, onclose);
+	#ifdef _WIN32
+		// Directory entries are written through on NTFS
+		return true;
+	#else
+		if(!fsync_dir(dir)){
+			return false;
+		}
+		// Directories made by create_path are only durable once the entry in
+		// their parent is, up to the first one that already was
+		string curr = dir;
+		while(true){
+			{
+				std::lock_guard<std::mutex> lock(fresh_dirs_mtx);
+				if(fresh_dirs.count(curr) == 0 && (!fresh_dirs_lost || curr == root || curr.size() < root.size())){
+					return true;
+				}
+			}
+			size_t up = curr.rfind('/');
+			string parent = up == string::npos ? "." : up == 0 ? "/" : curr.substr(0, up);
+			if(!fsync_dir(parent)){
+				return false;
+			}
+			{
+				std::lock_guard<std::mutex> lock(fresh_dirs_mtx);
+				fresh_dirs.erase(curr);
+			}
+			if(up == string::npos || up == 0){
+				return true;
+			}
+			curr = parent;
+		}
+	#endif
 }
 
-DBFS::File* DBFS::create(string filename)
+bool DBFS::details::fsync_dir(const string& dir)
 {
-	return new File(filename);
+	#ifdef _WIN32
+		return true;
+	#else
+		int d = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(d < 0){
+			return false;
+		}
+		int r = ::fsync(d);
+		::close(d);
+		return r == 0;
+	#endif
 }
 
-DBFS::string DBFS::random_filename()
+void DBFS::details::dir_created(const string& path)
 {
-	mtx_r.lock();
-	string ret = "";
-	for(int i=0;i<filelength;i++){
-		int rnd = mt_rand() % 36;
-		char c = rnd < 10 ? rnd+'0' : rnd-10+'a';
-		ret.push_back(c);
+	std::lock_guard<std::mutex> lock(fresh_dirs_mtx);
+	if(fresh_dirs.size() >= fresh_dirs_limit){
+		// Nobody syncs them, parents of every synced dir are synced from now on
+		fresh_dirs.clear();
+		fresh_dirs_lost = true;
 	}
-	
-	if(suffix_minutex){
-		unsigned int ctime = time(NULL)/60;
-		while(ctime > 0){
-			int rnd = ctime % 36;
-			ctime /= 36;
-			char c = rnd < 10 ? rnd+'0' : rnd-10+'a';
-			ret.push_back(c);
+	fresh_dirs.insert(path);
+}
+
+void DBFS::details::reaper_loop()
+{
+	#if defined(__linux__)
+		// Lowest priority for this thread only, elsewhere it would be the process
+		::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), 19);
+	#endif
+	size_t next = 0;
+	std::unique_lock<std::mutex> lock(reaper_mtx);
+	while(!reaper_stop){
+		// Ten batches per second keep the rmdir rate at `reaper_rate`
+		reaper_cv.wait_for(lock, std::chrono::milliseconds(100));
+		int n = std::max(reaper_rate / 10, 1);
+		lock.unlock();
+		// Stripes are visited round robin, one busy stripe does not starve others
+		for(int i=0;i<36*36 && n > 0 && reaper_pending > 0;i++){
+			std::lock_guard<std::mutex> slock(mtxs[next]);
+			auto& dirs = reaper_dirs[next];
+			while(!dirs.empty() && n > 0){
+				remove_dirs(*dirs.begin());
+				dirs.erase(dirs.begin());
+				reaper_pending--;
+				n--;
+			}
+			next = (next + 1) % (36*36);
 		}
+		lock.lock();
 	}
-	
-	mtx_r.unlock();
-	return ret;
 }
 
 void DBFS::set_root(string path)
@@ -442,3 +2725,252 @@ void DBFS::use_suffix_minutes(bool use)
 {
 	suffix_minutex = use;
 }
+
+void DBFS::set_dir_levels(int levels, int width)
+{
+	dir_levels = std::max(levels, 0);
+	dir_width = std::max(width, 1);
+}
+
+void DBFS::set_buffer_size(pos_t size)
+{
+	buffer_size = size;
+}
+
+DBFS::iobuf DBFS::alloc_iobuf(pos_t size)
+{
+	int c = details::iobuf_class(size);
+	pos_t cap = (pos_t)1 << c;
+	{
+		std::lock_guard<std::mutex> lock(iobuf_mtx);
+		if(!iobuf_free[c].empty()){
+			char* data = iobuf_free[c].back();
+			iobuf_free[c].pop_back();
+			iobuf_cached -= cap;
+			return {data, cap};
+		}
+	}
+	return {details::iobuf_alloc(cap), cap};
+}
+
+void DBFS::free_iobuf(iobuf buf)
+{
+	if(!buf.data){
+		return;
+	}
+	int c = details::iobuf_class(buf.size);
+	{
+		std::lock_guard<std::mutex> lock(iobuf_mtx);
+		if(iobuf_cached + buf.size <= iobuf_cache_limit){
+			iobuf_free[c].push_back(buf.data);
+			iobuf_cached += buf.size;
+			return;
+		}
+	}
+	details::iobuf_release(buf.data, buf.size);
+}
+
+void DBFS::use_huge_pages(bool use)
+{
+	huge_pages = use;
+}
+
+void DBFS::set_cache_size(pos_t size, pos_t block_size)
+{
+	// Readers check `cache_block` first, so it is off while shards change
+	cache_block = 0;
+	pos_t slots = block_size > 0 ? size / block_size / cache_shards : 0;
+	for(int i=0;i<cache_shards;i++){
+		cache_epochs[i]++;
+		cache_shard& sh = get_cache_shard(i);
+		std::lock_guard<std::mutex> lock(sh.mtx);
+		sh.files.clear();
+		sh.slots.assign(slots, cache_slot());
+		sh.data.assign(slots * block_size, 0);
+		sh.data.shrink_to_fit();
+		sh.hand = 0;
+	}
+	if(slots > 0){
+		cache_block = block_size;
+	}
+}
+
+DBFS::cache_shard& DBFS::get_cache_shard(size_t index)
+{
+	// Built on first use, files can be read from other static constructors
+	static cache_shard shards[cache_shards];
+	return shards[index % cache_shards];
+}
+
+DBFS::cache_shard& DBFS::get_cache_shard(const string& filename, pos_t block)
+{
+	// Consecutive blocks of a file land in consecutive shards
+	return get_cache_shard(std::hash<string>()(filename) + block);
+}
+
+size_t DBFS::cache_stripe(const string& filename)
+{
+	return std::hash<string>()(filename) % cache_shards;
+}
+
+void DBFS::cache_erase(cache_shard& sh, const string& filename, pos_t from, pos_t to)
+{
+	auto f = sh.files.find(filename);
+	if(f == sh.files.end()){
+		return;
+	}
+	for(auto it = f->second.begin(); it != f->second.end();){
+		if(it->first >= from && it->first <= to){
+			sh.slots[it->second] = cache_slot();
+			it = f->second.erase(it);
+		}
+		else{
+			++it;
+		}
+	}
+	if(f->second.empty()){
+		sh.files.erase(f);
+	}
+}
+
+DBFS::pos_t DBFS::details::cache_get(const string& filename, pos_t block, pos_t from, char* val, pos_t size)
+{
+	cache_shard& sh = get_cache_shard(filename, block);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+	// set_cache_size may be reshaping shards, block size has to match this one
+	pos_t bs = cache_block.load(std::memory_order_relaxed);
+	if(bs <= 0 || (pos_t)sh.data.size() != (pos_t)sh.slots.size() * bs){
+		return -1;
+	}
+	auto f = sh.files.find(filename);
+	if(f == sh.files.end()){
+		return -1;
+	}
+	auto b = f->second.find(block);
+	if(b == f->second.end()){
+		return -1;
+	}
+	cache_slot& slot = sh.slots[b->second];
+	slot.ref = true;
+	pos_t n = std::max(std::min(slot.size - from, size), (pos_t)0);
+	std::memcpy(val, sh.data.data() + b->second * bs + from, n);
+	return n;
+}
+
+void DBFS::details::cache_put(const string& filename, pos_t block, const char* val, pos_t size, unsigned long long epoch)
+{
+	pos_t bs = cache_block.load(std::memory_order_relaxed);
+	cache_shard& sh = get_cache_shard(filename, block);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+	// Invalidated while it was being read, data may be old already.
+	// Invalidation bumps the epoch before it takes shard locks, so a block
+	// stored after this check is still erased by it
+	if(cache_epochs[cache_stripe(filename)] != epoch || sh.slots.empty() || (pos_t)sh.data.size() != (pos_t)sh.slots.size() * bs){
+		return;
+	}
+	auto& blocks = sh.files[filename];
+	auto b = blocks.find(block);
+	size_t i;
+	if(b != blocks.end()){
+		i = b->second;
+	}
+	else{
+		// CLOCK: referenced slots get a second chance
+		while(sh.slots[sh.hand].name && sh.slots[sh.hand].ref){
+			sh.slots[sh.hand].ref = false;
+			sh.hand = (sh.hand + 1) % sh.slots.size();
+		}
+		i = sh.hand;
+		sh.hand = (sh.hand + 1) % sh.slots.size();
+		cache_slot& old = sh.slots[i];
+		if(old.name){
+			auto f = sh.files.find(*old.name);
+			f->second.erase(old.block);
+			if(f->second.empty() && f->first != filename){
+				sh.files.erase(f);
+			}
+		}
+		blocks[block] = i;
+	}
+	cache_slot& slot = sh.slots[i];
+	slot.name = &sh.files.find(filename)->first;
+	slot.block = block;
+	slot.size = size;
+	slot.ref = false;
+	std::memcpy(sh.data.data() + i * bs, val, size);
+}
+
+unsigned long long DBFS::details::cache_epoch(const string& filename, unsigned long long& renames)
+{
+	// Epoch first: cache_unlink bumps renames before the epoch, so a missed
+	// rename always comes with a missed epoch and the put fails
+	size_t i = cache_stripe(filename);
+	unsigned long long epoch = cache_epochs[i];
+	renames = cache_renames[i];
+	return epoch;
+}
+
+void DBFS::details::cache_invalidate(const string& filename, pos_t offset, pos_t size)
+{
+	pos_t bs = cache_block.load(std::memory_order_relaxed);
+	if(bs <= 0 || size <= 0){
+		return;
+	}
+	cache_epochs[cache_stripe(filename)]++;
+	pos_t from = offset / bs, to = (offset + size - 1) / bs;
+	if(to - from < cache_shards){
+		for(pos_t b=from;b<=to;b++){
+			cache_shard& sh = get_cache_shard(filename, b);
+			std::lock_guard<std::mutex> lock(sh.mtx);
+			cache_erase(sh, filename, b, b);
+		}
+		return;
+	}
+	// Large ranges touch every shard anyway
+	for(int i=0;i<cache_shards;i++){
+		cache_shard& sh = get_cache_shard(i);
+		std::lock_guard<std::mutex> lock(sh.mtx);
+		cache_erase(sh, filename, from, to);
+	}
+}
+
+void DBFS::details::cache_drop(const string& filename)
+{
+	if(cache_block.load(std::memory_order_relaxed) <= 0){
+		return;
+	}
+	cache_epochs[cache_stripe(filename)]++;
+	for(int i=0;i<cache_shards;i++){
+		cache_shard& sh = get_cache_shard(i);
+		std::lock_guard<std::mutex> lock(sh.mtx);
+		cache_erase(sh, filename, 0, std::numeric_limits<pos_t>::max());
+	}
+}
+
+void DBFS::details::cache_unlink(const string& filename)
+{
+	// Counted with the cache off too, it can be turned on while the old
+	// descriptor is still open
+	cache_renames[cache_stripe(filename)]++;
+	cache_drop(filename);
+}
+
+void DBFS::set_max_open_files(int count)
+{
+	max_open_files = count;
+	if(count <= 0){
+		return;
+	}
+	std::lock_guard<std::mutex> lock(pool_mtx);
+	while(pool_fds > max_open_files){
+		if(!details::evict_one(nullptr)){
+			break;
+		}
+	}
+}
+
+int DBFS::get_open_files()
+{
+	std::lock_guard<std::mutex> lock(pool_mtx);
+	return pool_fds;
+}
@@ -2,6 +2,9 @@
 #define DBFS_H
 
 #define DEBUG
+#define DBFS_METRICS
+// Byte order of read_binary/write_binary data, little endian if not defined
+// #define DBFS_BIG_ENDIAN
 
 #ifdef DEBUG
 	#include <errno.h>
@@ -11,6 +14,7 @@
 #endif
 
 #include <cstring>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
@@ -24,11 +28,33 @@
 #include <functional>
 #include <thread>
 #include <list>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <memory>
+#include <condition_variable>
+
+#include "dbfs_metrics.hpp"
+#include <atomic>
+#include <shared_mutex>
+#include <string_view>
+#include <type_traits>
+#include <charconv>
+#include <cctype>
+#include <limits>
 
 #ifdef _WIN32
 	#include <direct.h>
+	#include <io.h>
+	#include <fcntl.h>
 #else
 	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <sys/uio.h>
+	#include <dirent.h>
+	#include <sys/resource.h>
+	#include <sys/syscall.h>
+	#include <fcntl.h>
 	#include <unistd.h>
 #endif
 
@@ -40,8 +66,60 @@ namespace DBFS{
 	using pos_t = long int;
 	using fstream = std::fstream;
 	using file_hook_fn = std::function<void(File*)>;
+	using file_writer_fn = std::function<bool(File&)>;
+	
+	// Expected access pattern, see File::advise
+	enum advice_t { NORMAL, SEQUENTIAL, RANDOM, WILLNEED, DONTNEED };
+	
+	struct iobuf{
+		char* data;
+		pos_t size;
+	};
+	using iobufs = std::vector<iobuf>;
 	
+	extern string root;
 	extern int filelength;
+	extern int dir_levels;
+	extern int dir_width;
+	extern int max_open_files;
+	extern pos_t buffer_size;
+	extern pos_t direct_align;
+	extern std::atomic<pos_t> cache_block;
+	
+	// Reader-writer lock for many readers. Readers only touch the counter of
+	// their own slot, a writer raises `writer` and waits for all slots to drain
+	class rw_mutex{
+		public:
+			void lock();
+			void unlock();
+			bool try_lock();
+			
+			void lock_shared();
+			void unlock_shared();
+			bool try_lock_shared();
+			
+		private:
+			static const int slots = 16;
+			struct alignas(64) slot{
+				std::atomic<int> readers{0};
+			};
+			slot readers[slots];
+			std::atomic<bool> writer{false};
+			std::mutex wmtx;
+			#ifdef DBFS_METRICS
+				std::chrono::steady_clock::time_point held;
+			#endif
+			
+			slot& local();
+	};
+	
+	namespace details{
+		void pool_add(File* file);
+		void pool_remove(File* file);
+		bool pool_evict(File* except);
+		bool evict_one(File* except);
+		bool open_new(File* file);
+	}
 	
 	class File{
 		public:
@@ -59,9 +137,69 @@ namespace DBFS{
 			void write(char* val, pos_t size);
 			void read(char* val, pos_t size);
 			
+			template<typename T>
+			void write_binary(const T& val);
+			
+			template<typename T>
+			void read_binary(T& val);
+			
+			template<typename T>
+			void write_binary(const T* data, size_t count);
+			
+			template<typename T>
+			void read_binary(T* data, size_t count);
+			
+			template<typename T>
+			void write_binary(const std::vector<T>& data);
+			
+			template<typename T>
+			void read_binary(std::vector<T>& data);
+			
+			template<typename T>
+			void write_text(T val);
+			
+			template<typename T>
+			bool read_text(T& val, char sep = ' ');
+			
+			template<typename R>
+			void write_all(const R& range, char sep = ' ');
+			
+			template<typename R>
+			size_t read_all(R& range, char sep = ' ');
+			
+			pos_t read_at(pos_t offset, char* val, pos_t size);
+			pos_t write_at(pos_t offset, const char* val, pos_t size);
+			
+			pos_t readv(const iobufs& bufs);
+			pos_t writev(const iobufs& bufs);
+			pos_t readv_at(pos_t offset, const iobufs& bufs);
+			pos_t writev_at(pos_t offset, const iobufs& bufs);
+			
+			bool map(pos_t capacity = 0);
+			void unmap();
+			bool is_mapped();
+			bool msync(bool async = false);
+			// Invalidated once the mapping grows, see map_reserve
+			const char* data();
+			std::string_view view(pos_t offset, pos_t size);
+			
+			int handle();
+			void pin();
+			void unpin();
+			
 			bool open();
 			bool open(string filename);
 			void close();
+			bool flush();
+			bool sync();
+			bool reserve(pos_t size);
+			bool truncate(pos_t size);
+			bool punch_hole(pos_t offset, pos_t size);
+			bool advise(advice_t advice, pos_t offset = 0, pos_t size = 0);
+			void set_scan(bool use);
+			void set_buffer_size(pos_t size);
+			void set_direct(bool use);
+			bool is_direct();
 			
 			void seekp(pos_t p);
 			void seekg(pos_t p);
@@ -75,6 +213,7 @@ namespace DBFS{
 			
 			bool move(string newname);
 			bool remove();
+			bool commit_as(string newname, bool sync = true);
 			
 			bool is_open();
 			bool fail();
@@ -85,20 +224,96 @@ namespace DBFS{
 			
 			std::mutex& get_mutex();
 			std::lock_guard<std::mutex> get_lock();
+			rw_mutex& get_rw_mutex();
+			std::shared_lock<rw_mutex> get_shared_lock();
+			std::unique_lock<rw_mutex> get_unique_lock();
 			
 		private:
 			pos_t pos_p = 0, pos_g = 0;
 			bool p_updated = false, g_updated = false;
+			// Stream buffer given to `st`, must outlive it
+			std::vector<char> iobuf_data;
+			pos_t iobuf_size = 0;
 			fstream st;
 			bool opened = false;
 			string filename = "";
 			std::mutex mtx, rmtx;
 			std::list<file_hook_fn> on_close_fns, on_open_fns;
+			// Allocated on first get_rw_mutex()
+			std::atomic<rw_mutex*> rw{nullptr};
+			
+			// Raw descriptor for positional calls, opened on first use
+			std::atomic<int> fd{-1};
+			// Open raw descriptor with O_DIRECT, `direct_fd` tells if it succeeded
+			bool direct = false;
+			std::atomic<bool> direct_fd{false};
+			// Stream writes since the last flush, their blocks are dropped from
+			// the block cache once the data reaches the file
+			bool cache_dirty = false;
+			// Stream writes still held by the stream buffer, [cache_start,
+			// cache_end) or -1 if nothing is pending. See cache_written
+			pos_t cache_start = -1, cache_end = -1;
+			// Rename count of the cache shard when the descriptor was last
+			// checked to still back `filename`
+			std::atomic<unsigned long long> cache_seen{~0ULL};
+			// Scan mode drops pages behind the reader from the page cache
+			std::atomic<bool> scan{false};
+			pos_t scan_pending = 0;
+			std::atomic<pos_t> scan_done{0};
+			
+			// Memory mapping, guarded by `mmtx`
+			std::shared_mutex mmtx;
+			std::atomic<bool> mapped{false};
+			char* map_addr = nullptr;
+			pos_t map_cap = 0;
+			pos_t map_len = 0;
+			
+			// Descriptor pool state, guarded by `hmtx` and the pool mutex
+			std::shared_mutex hmtx;
+			bool pooled = false, evicted = false;
+			std::atomic<bool> pool_ref{false};
+			std::atomic<int> pins{0};
+			int pool_held = 0;
+			std::list<File*>::iterator pool_it;
+			pos_t evict_pos = 0;
+			std::ios_base::iostate evict_state = std::ios_base::goodbit;
+			
+			// Set by details::open_new, the file was just made with O_EXCL
+			// and is opened without checking that it exists
+			bool created = false;
 			
 			fstream create_stream(string filename);
+			bool open_stream();
+			bool reopen();
+			void evict();
+			std::unique_lock<std::shared_mutex> hold();
+			int raw_fd();
+			int descriptors();
+			void close_fd();
+			bool direct_ok(pos_t offset, const char* val, pos_t size);
+			void flush_stream();
+			pos_t read_raw(int d, pos_t offset, char* val, pos_t size);
+			pos_t read_cached(int d, pos_t offset, char* val, pos_t size);
+			bool cache_valid(int d, unsigned long long renames);
+			pos_t cache_from();
+			void cache_written(pos_t from, pos_t to);
+			void cache_pushed();
+			void scan_drop(pos_t end);
+			pos_t vector_io(int d, pos_t offset, const iobufs& bufs, bool write);
+			bool map_reserve(int d, pos_t len);
+			bool map_refresh();
+			pos_t map_read(pos_t offset, char* val, pos_t size);
+			pos_t map_write(pos_t offset, const char* val, pos_t size);
+			
+			friend void details::pool_add(File* file);
+			friend void details::pool_remove(File* file);
+			friend bool details::pool_evict(File* except);
+			friend bool details::evict_one(File* except);
+			friend bool details::open_new(File* file);
 	};
 	
 	string get_file_path(string filename);
+	void get_file_path(const string& filename, string& path);
 	string random_filename();
 	File* create();
 	File* create(string filename);
@@ -112,10 +327,90 @@ namespace DBFS{
 	void set_suffix(string suffix);
 	void set_filename_length(int length);
 	void use_suffix_minutes(bool use);
+	void set_dir_levels(int levels, int width);
+	long reshard(int old_levels, int old_width, int threads = 4);
+	void start_reaper(int rate = 1000);
+	bool load_catalog(int threads = 4);
+	void drop_catalog();
+	size_t catalog_size();
+	void stop_reaper();
+	bool sync_dir(string filename);
+	void start_group_commit(int window_us = 1000);
+	void stop_group_commit();
+	bool commit(File* file);
+	bool replace_atomic(string filename, const file_writer_fn& writer, bool sync = true);
+	void set_max_open_files(int count);
+	void set_buffer_size(pos_t size);
+	iobuf alloc_iobuf(pos_t size);
+	void free_iobuf(iobuf buf);
+	void use_huge_pages(bool use);
+	void set_cache_size(pos_t size, pos_t block_size = 4096);
+	int get_open_files();
 	
 	namespace details{	
+		#if defined(DBFS_BIG_ENDIAN)
+			const bool big_endian = true;
+		#else
+			const bool big_endian = false;
+		#endif
+		#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			const bool host_big_endian = true;
+		#else
+			const bool host_big_endian = false;
+		#endif
+		
+		// Only arithmetic values are swapped, layout of structs is up to the caller
+		template<typename T>
+		constexpr bool swap_bytes = big_endian != host_big_endian && std::is_arithmetic<T>::value && sizeof(T) > 1;
+		
+		template<typename T>
+		void byteswap(T* data, size_t count);
+		
+		std::mutex& stripe(string filename);
+		size_t stripe_index(const string& filename);
+		size_t dir_stripe(const string& dir);
+		std::mt19937_64 seed_random();
+		char base36(int val);
+		void build_path(const string& filename, int levels, int width, string& path);
+		using leaf_fn = std::function<void(const string& dir, const std::vector<string>& files)>;
+		bool for_each_leaf(int levels, int threads, const leaf_fn& fn);
+		void walk_dir(string dir, int depth, int levels, const leaf_fn& fn);
+		bool strip_name(const string& base, string& filename);
+		void list_dir(string dir, std::vector<string>& entries, bool dirs);
+		uint32_t crc32(const char* data, size_t size);
+		void list_entry(const string& dir, const char* name, unsigned char type, std::vector<string>& entries, bool dirs);
+		void track_create(const string& filename);
+		void track_move(const string& oldname, const string& newname);
+		void track_remove(const string& filename);
+		bool catalog_has(const string& filename);
+		void catalog_add(const string& filename);
+		void catalog_erase(const string& filename);
+		void catalog_scanned(const string& filename);
+		void catalog_loaded();
+		pos_t put_pending(std::streambuf* buf);
 		void create_path(string filename);
+		bool create_file(const string& filepath);
 		void remove_path(string filepath);
+		void remove_dirs(string path);
+		void reaper_loop();
+		bool sync_path(const string& dir);
+		bool fsync_dir(const string& dir);
+		void dir_created(const string& path);
+		void commit_loop();
+		bool commit_wait(File* file, const string& dir);
+		pos_t cache_get(const string& filename, pos_t block, pos_t from, char* val, pos_t size);
+		void cache_put(const string& filename, pos_t block, const char* val, pos_t size, unsigned long long epoch);
+		unsigned long long cache_epoch(const string& filename, unsigned long long& renames);
+		void cache_invalidate(const string& filename, pos_t offset, pos_t size);
+		void cache_drop(const string& filename);
+		void cache_unlink(const string& filename);
+		bool dir_known(const string& path);
+		void dir_add(const string& path);
+		void dir_forget(const string& path);
+		void forget_path(const string& filepath);
+		int iobuf_class(pos_t size);
+		char* iobuf_alloc(pos_t size);
+		void iobuf_release(char* data, pos_t size);
 		int mkdir(string path);
 		int rmdir(string path);
 	}
@@ -126,6 +421,8 @@ namespace DBFS{
 template<typename T>
 void DBFS::File::read(T& val)
 {
+	DBFS_METRIC_START(metric, READ);
+	auto lock = hold();
 	#ifdef DEBUG
 	if(st.fail()){
 		SHOW_ERROR;
@@ -133,6 +430,7 @@ void DBFS::File::read(T& val)
 	}
 	#endif
 	st >> val;
+	cache_pushed();
 	#ifdef DEBUG
 	if(st.fail()){
 		SHOW_ERROR;
@@ -141,11 +439,15 @@ void DBFS::File::read(T& val)
 	#endif
 	pos_g += st.gcount();
 	g_updated = false;
+	DBFS_METRIC_DONE(metric, st.gcount(), st.fail());
 }
 
 template<typename T>
 void DBFS::File::write(T val)
 {
+	DBFS_METRIC_START(metric, WRITE);
+	auto lock = hold();
+	pos_t from = cache_from();
 	st << val;
 	#ifdef DEBUG
 	if(st.fail()){
@@ -154,6 +456,156 @@ void DBFS::File::write(T val)
 	}
 	#endif
 	p_updated = false;
+	cache_dirty = true;
+	if(from >= 0){
+		cache_written(from, st.tellp());
+	}
+	DBFS_METRIC_DONE(metric, 0, st.fail());
+}
+
+template<typename T>
+void DBFS::File::write_binary(const T& val)
+{
+	write_binary(&val, 1);
+}
+
+template<typename T>
+void DBFS::File::read_binary(T& val)
+{
+	read_binary(&val, 1);
+}
+
+template<typename T>
+void DBFS::File::write_binary(const T* data, size_t count)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "write_binary needs trivially copyable type");
+	if constexpr(details::swap_bytes<T>){
+		std::vector<T> tmp(data, data + count);
+		details::byteswap(tmp.data(), count);
+		write((char*)tmp.data(), count * sizeof(T));
+	}
+	else{
+		write((char*)data, count * sizeof(T));
+	}
+}
+
+template<typename T>
+void DBFS::File::read_binary(T* data, size_t count)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "read_binary needs trivially copyable type");
+	read((char*)data, count * sizeof(T));
+	if constexpr(details::swap_bytes<T>){
+		details::byteswap(data, count);
+	}
+}
+
+template<typename T>
+void DBFS::File::write_binary(const std::vector<T>& data)
+{
+	write_binary(data.data(), data.size());
+}
+
+template<typename T>
+void DBFS::File::read_binary(std::vector<T>& data)
+{
+	read_binary(data.data(), data.size());
+}
+
+template<typename T>
+void DBFS::File::write_text(T val)
+{
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "write_text needs arithmetic type other than bool, write it as an integer");
+	char buf[64];
+	auto r = std::to_chars(buf, buf + sizeof(buf), val);
+	write(buf, r.ptr - buf);
+}
+
+template<typename T>
+bool DBFS::File::read_text(T& val, char sep)
+{
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "read_text needs arithmetic type other than bool, read it as an integer");
+	DBFS_METRIC_START(metric, READ);
+	auto lock = hold();
+	// Characters are taken from the stream buffer one by one, which is
+	// inlined and does not touch the sentry or locale
+	if(!st.good()){
+		st.setstate(std::ios::failbit);
+		return false;
+	}
+	auto buf = st.rdbuf();
+	pos_t consumed = 0;
+	int c = buf->sgetc();
+	while(c != EOF && (c == sep || std::isspace(c))){
+		c = buf->snextc();
+		consumed++;
+	}
+	char text[64];
+	int len = 0;
+	while(c != EOF && c != sep && !std::isspace(c) && len < (int)sizeof(text)){
+		text[len++] = c;
+		c = buf->snextc();
+	}
+	// Token did not fit, parsing its head would give a wrong number
+	bool cut = c != EOF && c != sep && !std::isspace(c);
+	consumed += len;
+	cache_pushed();
+	pos_g += consumed;
+	g_updated = false;
+	auto r = std::from_chars(text, text + len, val);
+	if(len == 0 || cut || r.ec != std::errc() || r.ptr != text + len){
+		st.setstate(c == EOF ? std::ios::eofbit | std::ios::failbit : std::ios::failbit);
+		DBFS_METRIC_DONE(metric, consumed, true);
+		return false;
+	}
+	DBFS_METRIC_DONE(metric, consumed, false);
+	return true;
+}
+
+template<typename R>
+void DBFS::File::write_all(const R& range, char sep)
+{
+	// Formatted into one chunk, so the stream is called once per 64KB
+	string chunk;
+	chunk.reserve(1 << 16);
+	bool first = true;
+	for(const auto& it : range){
+		if(!first){
+			chunk.push_back(sep);
+		}
+		first = false;
+		char buf[64];
+		auto r = std::to_chars(buf, buf + sizeof(buf), it);
+		chunk.append(buf, r.ptr - buf);
+		if(chunk.size() >= (1 << 16) - 64){
+			write(&chunk[0], chunk.size());
+			chunk.clear();
+		}
+	}
+	if(!chunk.empty()){
+		write(&chunk[0], chunk.size());
+	}
+}
+
+template<typename R>
+size_t DBFS::File::read_all(R& range, char sep)
+{
+	size_t count = 0;
+	for(auto& it : range){
+		if(!read_text(it, sep)){
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+template<typename T>
+void DBFS::details::byteswap(T* data, size_t count)
+{
+	for(size_t i=0;i<count;i++){
+		char* p = (char*)(data + i);
+		std::reverse(p, p + sizeof(T));
+	}
 }
 
 #endif // DBFS_H
@@ -0,0 +1,557 @@
+#include "dbfs_async.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+	#define DBFS_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+#endif
+
+namespace DBFS{
+	namespace async{
+		
+		enum op_t { OP_READ, OP_WRITE, OP_FSYNC, OP_STOP };
+		
+		struct request{
+			op_t op;
+			File* file = nullptr;
+			char* val = nullptr;
+			pos_t offset = 0, size = 0, done = 0;
+			result_fn fn;
+		};
+		
+		// Built on first use and never destroyed, the engine can be used from
+		// other static constructors and destructors
+		struct state_t{
+			std::mutex mtx;
+			bool started = false;
+			
+			std::vector<std::thread> workers;
+			std::queue<std::function<void()>> tasks;
+			std::mutex tasks_mtx;
+			std::condition_variable tasks_cv;
+			bool workers_stop = false;
+			
+			#ifdef DBFS_IO_URING
+			std::thread reaper;
+			std::mutex sq_mtx;
+			std::condition_variable sq_cv;
+			unsigned inflight = 0;
+			#endif
+		};
+		state_t& state();
+		
+		#ifdef DBFS_IO_URING
+		int ring_fd = -1;
+		unsigned ring_entries = 0;
+		void* sq_ptr = nullptr;
+		void* cq_ptr = nullptr;
+		size_t sq_size = 0, cq_size = 0;
+		io_uring_sqe* sqes = nullptr;
+		unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+		unsigned *cq_head, *cq_tail, *cq_mask;
+		io_uring_cqe* cqes = nullptr;
+		
+		bool ring_setup(unsigned entries);
+		void ring_teardown();
+		void ring_submit(request* req, bool owned = false);
+		void ring_reap();
+		void complete(request* req, pos_t res);
+		#endif
+		
+		void worker();
+		void ensure_started();
+		
+		// Joins engine threads before static destruction
+		struct guard_t{
+			~guard_t(){ stop(); }
+		} guard;
+		
+		template<typename T>
+		std::pair<std::future<T>, std::function<void(T)>> make_promise();
+	}
+}
+
+DBFS::async::state_t& DBFS::async::state()
+{
+	static state_t* st = new state_t();
+	return *st;
+}
+
+void DBFS::async::start(int queue_depth, int threads)
+{
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(st.started){
+		return;
+	}
+	st.workers_stop = false;
+	for(int i=0;i<std::max(threads, 1);i++){
+		st.workers.emplace_back(worker);
+	}
+	#ifdef DBFS_IO_URING
+	if(ring_setup(queue_depth)){
+		st.reaper = std::thread(ring_reap);
+	}
+	#endif
+	st.started = true;
+}
+
+void DBFS::async::stop()
+{
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(!st.started){
+		return;
+	}
+	#ifdef DBFS_IO_URING
+	if(ring_fd >= 0){
+		{
+			std::unique_lock<std::mutex> sq_lock(st.sq_mtx);
+			st.sq_cv.wait(sq_lock, [&]{ return st.inflight == 0; });
+		}
+		request* req = new request();
+		req->op = OP_STOP;
+		ring_submit(req);
+		st.reaper.join();
+		ring_teardown();
+	}
+	#endif
+	{
+		std::lock_guard<std::mutex> tasks_lock(st.tasks_mtx);
+		st.workers_stop = true;
+	}
+	st.tasks_cv.notify_all();
+	for(auto& it : st.workers){
+		it.join();
+	}
+	st.workers.clear();
+	st.started = false;
+}
+
+bool DBFS::async::uses_io_uring()
+{
+	ensure_started();
+	#ifdef DBFS_IO_URING
+	return ring_fd >= 0;
+	#else
+	return false;
+	#endif
+}
+
+std::future<DBFS::pos_t> DBFS::async::read(File* file, pos_t offset, char* val, pos_t size)
+{
+	auto p = make_promise<pos_t>();
+	read(file, offset, val, size, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::read(File* file, pos_t offset, char* val, pos_t size, result_fn fn)
+{
+	ensure_started();
+	#ifdef DBFS_IO_URING
+	if(ring_fd >= 0 && !file->is_mapped()){
+		request* req = new request();
+		req->op = OP_READ;
+		req->file = file;
+		req->val = val;
+		req->offset = offset;
+		req->size = size;
+		req->fn = fn;
+		file->pin();
+		ring_submit(req);
+		return;
+	}
+	#endif
+	details::submit([=](){
+		fn(details::run_read(file, offset, val, size));
+	});
+}
+
+std::future<DBFS::pos_t> DBFS::async::write(File* file, pos_t offset, const char* val, pos_t size)
+{
+	auto p = make_promise<pos_t>();
+	write(file, offset, val, size, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::write(File* file, pos_t offset, const char* val, pos_t size, result_fn fn)
+{
+	ensure_started();
+	#ifdef DBFS_IO_URING
+	if(ring_fd >= 0 && !file->is_mapped()){
+		request* req = new request();
+		req->op = OP_WRITE;
+		req->file = file;
+		req->val = const_cast<char*>(val);
+		req->offset = offset;
+		req->size = size;
+		req->fn = fn;
+		file->pin();
+		ring_submit(req);
+		return;
+	}
+	#endif
+	details::submit([=](){
+		fn(details::run_write(file, offset, val, size));
+	});
+}
+
+std::future<DBFS::pos_t> DBFS::async::fsync(File* file)
+{
+	auto p = make_promise<pos_t>();
+	fsync(file, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::fsync(File* file, result_fn fn)
+{
+	ensure_started();
+	#ifdef DBFS_IO_URING
+	if(ring_fd >= 0 && !file->is_mapped()){
+		request* req = new request();
+		req->op = OP_FSYNC;
+		req->file = file;
+		req->fn = fn;
+		file->pin();
+		ring_submit(req);
+		return;
+	}
+	#endif
+	details::submit([=](){
+		fn(details::run_fsync(file));
+	});
+}
+
+std::future<DBFS::File*> DBFS::async::create()
+{
+	auto p = make_promise<File*>();
+	create(p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::create(file_fn fn)
+{
+	ensure_started();
+	details::submit([=](){
+		fn(DBFS::create());
+	});
+}
+
+std::future<DBFS::File*> DBFS::async::open(string filename)
+{
+	auto p = make_promise<File*>();
+	open(filename, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::open(string filename, file_fn fn)
+{
+	ensure_started();
+	details::submit([=](){
+		fn(DBFS::create(filename));
+	});
+}
+
+std::future<bool> DBFS::async::move(string oldname, string newname)
+{
+	auto p = make_promise<bool>();
+	move(oldname, newname, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::move(string oldname, string newname, bool_fn fn)
+{
+	ensure_started();
+	// Not sent to the ring, the name has to stay locked while it changes
+	details::submit([=](){
+		fn(DBFS::move(oldname, newname));
+	});
+}
+
+std::future<bool> DBFS::async::remove(string filename)
+{
+	auto p = make_promise<bool>();
+	remove(filename, p.second);
+	return std::move(p.first);
+}
+
+void DBFS::async::remove(string filename, bool_fn fn)
+{
+	ensure_started();
+	details::submit([=](){
+		fn(DBFS::remove(filename));
+	});
+}
+
+void DBFS::async::details::submit(std::function<void()> task)
+{
+	state_t& st = state();
+	{
+		std::lock_guard<std::mutex> lock(st.tasks_mtx);
+		st.tasks.push(std::move(task));
+	}
+	st.tasks_cv.notify_one();
+}
+
+DBFS::pos_t DBFS::async::details::run_read(File* file, pos_t offset, char* val, pos_t size)
+{
+	pos_t r = file->read_at(offset, val, size);
+	return r < 0 ? -errno : r;
+}
+
+DBFS::pos_t DBFS::async::details::run_write(File* file, pos_t offset, const char* val, pos_t size)
+{
+	pos_t r = file->write_at(offset, val, size);
+	return r < 0 ? -errno : r;
+}
+
+DBFS::pos_t DBFS::async::details::run_fsync(File* file)
+{
+	if(file->is_mapped()){
+		return file->msync() ? 0 : -errno;
+	}
+	file->pin();
+	int d = file->handle();
+	int r = -EBADF;
+	if(d >= 0){
+		#ifdef _WIN32
+			r = ::_commit(d) ? -errno : 0;
+		#else
+			r = ::fdatasync(d) ? -errno : 0;
+		#endif
+	}
+	file->unpin();
+	return r;
+}
+
+void DBFS::async::worker()
+{
+	state_t& st = state();
+	while(true){
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(st.tasks_mtx);
+			st.tasks_cv.wait(lock, [&]{ return st.workers_stop || !st.tasks.empty(); });
+			if(st.tasks.empty()){
+				return;
+			}
+			task = std::move(st.tasks.front());
+			st.tasks.pop();
+		}
+		task();
+	}
+}
+
+void DBFS::async::ensure_started()
+{
+	state_t& st = state();
+	{
+		std::lock_guard<std::mutex> lock(st.mtx);
+		if(st.started){
+			return;
+		}
+	}
+	start();
+}
+
+template<typename T>
+std::pair<std::future<T>, std::function<void(T)>> DBFS::async::make_promise()
+{
+	auto promise = std::make_shared<std::promise<T>>();
+	std::future<T> future = promise->get_future();
+	return {std::move(future), [promise](T val){ promise->set_value(val); }};
+}
+
+#ifdef DBFS_IO_URING
+
+bool DBFS::async::ring_setup(unsigned entries)
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	ring_fd = ::syscall(__NR_io_uring_setup, entries, &p);
+	if(ring_fd < 0){
+		// Not available (old kernel, seccomp, io_uring_disabled), use workers
+		return false;
+	}
+	ring_entries = p.sq_entries;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		sq_size = cq_size = std::max(sq_size, cq_size);
+	}
+	sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED){
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		cq_ptr = sq_ptr;
+	}
+	else{
+		cq_ptr = ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	}
+	void* sqes_ptr = ::mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(cq_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED){
+		if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr){
+			::munmap(cq_ptr, cq_size);
+		}
+		::munmap(sq_ptr, sq_size);
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+	sqes = (io_uring_sqe*)sqes_ptr;
+	char* sq = (char*)sq_ptr;
+	char* cq = (char*)cq_ptr;
+	sq_head = (unsigned*)(sq + p.sq_off.head);
+	sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + p.sq_off.array);
+	cq_head = (unsigned*)(cq + p.cq_off.head);
+	cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+	state().inflight = 0;
+	return true;
+}
+
+void DBFS::async::ring_teardown()
+{
+	::munmap(sqes, ring_entries * sizeof(io_uring_sqe));
+	if(cq_ptr != sq_ptr){
+		::munmap(cq_ptr, cq_size);
+	}
+	::munmap(sq_ptr, sq_size);
+	::close(ring_fd);
+	ring_fd = -1;
+}
+
+void DBFS::async::ring_submit(request* req, bool owned)
+{
+	state_t& st = state();
+	std::unique_lock<std::mutex> lock(st.sq_mtx);
+	// Do not overflow completion queue, wait for reaper to free a slot.
+	// `owned` requests are resent by the reaper in the slot they still hold,
+	// it must not wait for itself
+	if(!owned){
+		st.sq_cv.wait(lock, [&]{ return st.inflight < ring_entries; });
+		st.inflight++;
+	}
+	
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	io_uring_sqe* sqe = &sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (unsigned long long)req;
+	switch(req->op){
+		case OP_READ:
+		case OP_WRITE:
+			sqe->opcode = req->op == OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+			sqe->fd = req->file->handle();
+			sqe->addr = (unsigned long long)(req->val + req->done);
+			sqe->len = req->size - req->done;
+			sqe->off = req->offset + req->done;
+			break;
+		case OP_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = req->file->handle();
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			break;
+		case OP_STOP:
+			sqe->opcode = IORING_OP_NOP;
+			break;
+	}
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	
+	while(::syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR);
+}
+
+void DBFS::async::complete(request* req, pos_t res)
+{
+	// Callbacks run on the pool, one that submits more I/O may wait for a
+	// free slot, and only the reaper frees them
+	File* file = req->file;
+	result_fn fn = std::move(req->fn);
+	details::submit([=](){
+		file->unpin();
+		fn(res);
+	});
+}
+
+void DBFS::async::ring_reap()
+{
+	state_t& st = state();
+	while(true){
+		int r = ::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if(r < 0 && errno != EINTR){
+			#ifdef DEBUG
+			SHOW_ERROR;
+			#endif
+			return;
+		}
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		std::vector<std::pair<request*, int>> done;
+		while(head != tail){
+			io_uring_cqe* cqe = &cqes[head & *cq_mask];
+			done.emplace_back((request*)cqe->user_data, cqe->res);
+			head++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		
+		bool stop = false;
+		for(auto& it : done){
+			request* req = it.first;
+			int res = it.second;
+			if(req->op == OP_WRITE && res > 0 && req->done + res < req->size){
+				// Short write, the rest goes out in the same slot
+				req->done += res;
+				ring_submit(req, true);
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lock(st.sq_mtx);
+				st.inflight--;
+			}
+			st.sq_cv.notify_all();
+			switch(req->op){
+				case OP_READ:
+				case OP_WRITE:
+					if(res == -EINVAL || res == -EOPNOTSUPP){
+						// Opcode is not supported by this kernel
+						File* file = req->file;
+						pos_t offset = req->offset, size = req->size;
+						char* val = req->val;
+						result_fn fn = req->fn;
+						bool rd = req->op == OP_READ;
+						details::submit([=](){
+							fn(rd ? details::run_read(file, offset, val, size) : details::run_write(file, offset, val, size));
+							file->unpin();
+						});
+						req = nullptr;
+						break;
+					}
+					if(req->op == OP_WRITE && (res > 0 || req->done > 0)){
+						// Written behind File::write_at, cached blocks are old now
+						DBFS::details::cache_invalidate(req->file->name(), req->offset, req->size);
+					}
+					complete(req, res < 0 ? res : req->done + res);
+					break;
+				case OP_FSYNC:
+					complete(req, res);
+					break;
+				case OP_STOP:
+					stop = true;
+					break;
+			}
+			delete req;
+		}
+		if(stop){
+			return;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef DBFS_ASYNC_H
+#define DBFS_ASYNC_H
+
+#include "dbfs.hpp"
+
+#include <future>
+#include <memory>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+
+namespace DBFS{
+	
+	namespace async{
+		
+		// Result of read/write/fsync: number of bytes (0 for fsync) or -errno
+		using result_fn = std::function<void(pos_t)>;
+		using bool_fn = std::function<void(bool)>;
+		using file_fn = std::function<void(File*)>;
+		
+		void start(int queue_depth = 256, int threads = 4);
+		void stop();
+		bool uses_io_uring();
+		
+		std::future<pos_t> read(File* file, pos_t offset, char* val, pos_t size);
+		void read(File* file, pos_t offset, char* val, pos_t size, result_fn fn);
+		
+		std::future<pos_t> write(File* file, pos_t offset, const char* val, pos_t size);
+		void write(File* file, pos_t offset, const char* val, pos_t size, result_fn fn);
+		
+		std::future<pos_t> fsync(File* file);
+		void fsync(File* file, result_fn fn);
+		
+		std::future<File*> create();
+		void create(file_fn fn);
+		
+		std::future<File*> open(string filename);
+		void open(string filename, file_fn fn);
+		
+		std::future<bool> move(string oldname, string newname);
+		void move(string oldname, string newname, bool_fn fn);
+		
+		std::future<bool> remove(string filename);
+		void remove(string filename, bool_fn fn);
+		
+		namespace details{
+			void submit(std::function<void()> task);
+			pos_t run_read(File* file, pos_t offset, char* val, pos_t size);
+			pos_t run_write(File* file, pos_t offset, const char* val, pos_t size);
+			pos_t run_fsync(File* file);
+		}
+	}
+}
+
+#endif // DBFS_ASYNC_H
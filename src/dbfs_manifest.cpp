@@ -0,0 +1,462 @@
+#include "dbfs_manifest.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <iterator>
+
+namespace DBFS{
+	namespace manifest{
+		
+		// One line per event: `<op> <size> <name> [<newname>] <crc32>`, where op is
+		// C - created or resized, M - moved, R - removed, E - closed cleanly.
+		// Log without E at the end was not closed and is considered stale
+		std::atomic<bool> on{false};
+		
+		// Built on first use, manifest can be opened from other static constructors
+		struct state_t{
+			std::mutex mtx;
+			string path;
+			int fd = -1;
+			std::unordered_map<string, pos_t> live;
+			size_t records = 0;
+			// Bumped whenever the log file is replaced, a background rewrite
+			// started before it is dropped
+			unsigned gen = 0;
+			
+			// Compaction thread, runs while the manifest is open
+			std::thread compactor;
+			std::condition_variable cv;
+			bool wanted = false;
+			bool stop = false;
+		};
+		state_t& state();
+		
+		// Writes E record before static destruction. Touching the state first
+		// makes sure it is destroyed after the guard
+		struct guard_t{
+			guard_t(){ state(); }
+			~guard_t(){ close(); }
+		} guard;
+	}
+}
+
+DBFS::manifest::state_t& DBFS::manifest::state()
+{
+	static state_t st;
+	return st;
+}
+
+bool DBFS::manifest::open(string path, int threads)
+{
+	close();
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	st.path = path.empty() ? root + "/.manifest" : path;
+	st.live.clear();
+	st.records = 0;
+	bool loaded = details::load();
+	if(loaded){
+		DBFS::details::create_path(st.path);
+		st.fd = details::open_log(st.path, false);
+	}
+	else{
+		st.live.clear();
+		details::scan(threads);
+		details::rewrite();
+	}
+	on = true;
+	st.wanted = st.stop = false;
+	st.compactor = std::thread(details::compaction_loop);
+	return loaded;
+}
+
+void DBFS::manifest::close()
+{
+	state_t& st = state();
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> lock(st.mtx);
+		if(!on){
+			return;
+		}
+		on = false;
+		details::append('E', 0, "");
+		details::close_log(st.fd);
+		st.gen++;
+		st.stop = true;
+		t = std::move(st.compactor);
+	}
+	st.cv.notify_all();
+	if(t.joinable()){
+		t.join();
+	}
+}
+
+bool DBFS::manifest::is_open()
+{
+	return on;
+}
+
+std::vector<DBFS::manifest::entry> DBFS::manifest::list()
+{
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	std::vector<entry> ret;
+	ret.reserve(st.live.size());
+	for(auto& it : st.live){
+		ret.push_back({it.first, it.second});
+	}
+	return ret;
+}
+
+void DBFS::manifest::compact()
+{
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(on){
+		details::rewrite();
+	}
+}
+
+void DBFS::manifest::details::created(const string& filename)
+{
+	if(!on.load(std::memory_order_relaxed)){
+		return;
+	}
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(on && st.live.emplace(filename, 0).second){
+		append('C', 0, filename);
+	}
+}
+
+void DBFS::manifest::details::moved(const string& oldname, const string& newname)
+{
+	if(!on.load(std::memory_order_relaxed)){
+		return;
+	}
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	auto it = st.live.find(oldname);
+	if(!on || it == st.live.end()){
+		return;
+	}
+	pos_t size = it->second;
+	st.live.erase(it);
+	st.live[newname] = size;
+	append('M', 0, oldname, newname);
+}
+
+void DBFS::manifest::details::removed(const string& filename)
+{
+	if(!on.load(std::memory_order_relaxed)){
+		return;
+	}
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(on && st.live.erase(filename)){
+		append('R', 0, filename);
+	}
+}
+
+void DBFS::manifest::details::closed(const string& filename)
+{
+	if(!on.load(std::memory_order_relaxed)){
+		return;
+	}
+	#ifdef _WIN32
+		struct _stat64 sb;
+		if(::_stat64(get_file_path(filename).c_str(), &sb) != 0){
+			return;
+		}
+	#else
+		struct stat sb;
+		if(::stat(get_file_path(filename).c_str(), &sb) != 0){
+			return;
+		}
+	#endif
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.mtx);
+	auto it = st.live.find(filename);
+	// Only size changes are logged
+	if(!on || it == st.live.end() || it->second == (pos_t)sb.st_size){
+		return;
+	}
+	it->second = sb.st_size;
+	append('C', it->second, filename);
+}
+
+bool DBFS::manifest::details::load()
+{
+	state_t& st = state();
+	bool clean = false;
+	return parse(st.path, -1, st.live, st.records, clean) && clean;
+}
+
+bool DBFS::manifest::details::parse(const string& path, pos_t limit, std::unordered_map<string, pos_t>& live, size_t& records, bool& clean)
+{
+	std::ifstream in(path, std::ios::binary);
+	if(!in.is_open()){
+		return false;
+	}
+	clean = false;
+	pos_t consumed = 0;
+	string line, name, newname;
+	while((limit < 0 || consumed < limit) && std::getline(in, line)){
+		consumed += line.size() + 1;
+		size_t end = line.rfind(' ');
+		if(end == string::npos || end + 9 != line.size() || end < 3){
+			return false;
+		}
+		if(std::strtoul(line.c_str() + end + 1, nullptr, 16) != DBFS::details::crc32(line.data(), end)){
+			return false;
+		}
+		char op = line[0];
+		char* pos;
+		pos_t size = std::strtoll(line.c_str() + 2, &pos, 10);
+		size_t from = pos - line.c_str() + 1;
+		size_t sp = std::min(line.find(' ', from), end);
+		name.assign(line, std::min(from, end), sp - std::min(from, end));
+		newname.assign(line, sp, end - sp);
+		if(!newname.empty()){
+			newname.erase(0, 1);
+		}
+		clean = op == 'E';
+		switch(op){
+			case 'C':
+				live[name] = size;
+				break;
+			case 'M':{
+				auto it = live.find(name);
+				if(it != live.end()){
+					pos_t s = it->second;
+					live.erase(it);
+					live[newname] = s;
+				}
+				break;
+			}
+			case 'R':
+				live.erase(name);
+				break;
+			case 'E':
+				break;
+			default:
+				return false;
+		}
+		records++;
+	}
+	return true;
+}
+
+void DBFS::manifest::details::scan(int threads)
+{
+	state_t& st = state();
+	std::mutex scan_mtx;
+	DBFS::details::for_each_leaf(dir_levels, threads, [&](const string& dir, const std::vector<string>& files){
+		std::vector<entry> found;
+		string filename;
+		for(auto& it : files){
+			struct stat sb;
+			if(DBFS::details::strip_name(it.substr(dir.size() + 1), filename) && ::stat(it.c_str(), &sb) == 0){
+				found.push_back({filename, (pos_t)sb.st_size});
+			}
+		}
+		std::lock_guard<std::mutex> lock(scan_mtx);
+		for(auto& it : found){
+			st.live[it.name] = it.size;
+		}
+	});
+}
+
+void DBFS::manifest::details::append(char op, pos_t size, const string& name, const string& newname)
+{
+	state_t& st = state();
+	string line = format(op, size, name, newname);
+	write_log(st.fd, line);
+	st.records++;
+	
+	// Compact once dead records outnumber live ones. Rewriting is O(live
+	// names), so it is left to the compaction thread
+	if(op != 'E' && !st.wanted && st.records > 2 * st.live.size() + 1024){
+		st.wanted = true;
+		st.cv.notify_one();
+	}
+}
+
+DBFS::string DBFS::manifest::details::format(char op, pos_t size, const string& name, const string& newname)
+{
+	string line;
+	line.reserve(name.size() + newname.size() + 40);
+	line.push_back(op);
+	line.push_back(' ');
+	line += std::to_string(size);
+	if(!name.empty()){
+		line.push_back(' ');
+		line += name;
+	}
+	if(!newname.empty()){
+		line.push_back(' ');
+		line += newname;
+	}
+	char crc[16];
+	std::snprintf(crc, sizeof(crc), " %08x\n", (unsigned)DBFS::details::crc32(line.data(), line.size()));
+	line += crc;
+	return line;
+}
+
+void DBFS::manifest::details::rewrite()
+{
+	state_t& st = state();
+	// Write live set aside and swap it in with rename, so the old log stays
+	// valid until the new one is complete
+	string tmp = st.path + ".tmp";
+	close_log(st.fd);
+	DBFS::details::create_path(st.path);
+	st.fd = open_log(tmp, true);
+	st.records = 0;
+	string buf;
+	for(auto& it : st.live){
+		buf += format('C', it.second, it.first, "");
+		st.records++;
+		if(buf.size() >= 1 << 20){
+			write_log(st.fd, buf);
+			buf.clear();
+		}
+	}
+	write_log(st.fd, buf);
+	close_log(st.fd);
+	std::rename(tmp.c_str(), st.path.c_str());
+	st.fd = open_log(st.path, false);
+	st.gen++;
+}
+
+void DBFS::manifest::details::compaction_loop()
+{
+	state_t& st = state();
+	std::unique_lock<std::mutex> lock(st.mtx);
+	while(true){
+		st.cv.wait(lock, [&]{ return st.stop || st.wanted; });
+		if(st.stop){
+			return;
+		}
+		lock.unlock();
+		compact_log();
+		lock.lock();
+		st.wanted = false;
+	}
+}
+
+void DBFS::manifest::details::compact_log()
+{
+	// Only the log prefix written so far is replayed from disk and rewritten
+	// without the lock. Records appended meanwhile are copied over under the
+	// lock at the end, which is short
+	state_t& st = state();
+	string path, tmp;
+	pos_t prefix;
+	unsigned gen;
+	{
+		std::lock_guard<std::mutex> lock(st.mtx);
+		if(!on){
+			return;
+		}
+		path = st.path;
+		tmp = path + ".tmp";
+		gen = st.gen;
+		prefix = log_size(st.fd);
+	}
+	std::unordered_map<string, pos_t> live;
+	size_t records = 0;
+	bool clean;
+	if(prefix < 0 || !parse(path, prefix, live, records, clean)){
+		// Damaged log, the listing in memory is the only good copy left
+		std::lock_guard<std::mutex> lock(st.mtx);
+		if(on && gen == st.gen){
+			rewrite();
+		}
+		return;
+	}
+	int fd = open_log(tmp, true);
+	string buf;
+	records = 0;
+	for(auto& it : live){
+		buf += format('C', it.second, it.first, "");
+		records++;
+		if(buf.size() >= 1 << 20){
+			write_log(fd, buf);
+			buf.clear();
+		}
+	}
+	write_log(fd, buf);
+	live.clear();
+	
+	std::lock_guard<std::mutex> lock(st.mtx);
+	if(!on || gen != st.gen){
+		close_log(fd);
+		std::remove(tmp.c_str());
+		return;
+	}
+	std::ifstream in(path, std::ios::binary);
+	in.seekg(prefix);
+	string tail((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	write_log(fd, tail);
+	records += std::count(tail.begin(), tail.end(), '\n');
+	close_log(fd);
+	close_log(st.fd);
+	std::rename(tmp.c_str(), path.c_str());
+	st.fd = open_log(path, false);
+	st.records = records;
+	st.gen++;
+}
+
+DBFS::pos_t DBFS::manifest::details::log_size(int fd)
+{
+	#ifdef _WIN32
+		struct _stat64 sb;
+		return fd >= 0 && ::_fstat64(fd, &sb) == 0 ? (pos_t)sb.st_size : -1;
+	#else
+		struct stat sb;
+		return fd >= 0 && ::fstat(fd, &sb) == 0 ? (pos_t)sb.st_size : -1;
+	#endif
+}
+
+int DBFS::manifest::details::open_log(const string& path, bool truncate)
+{
+	#ifdef _WIN32
+		return ::_open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : _O_APPEND), _S_IREAD | _S_IWRITE);
+	#else
+		return ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND), 0644);
+	#endif
+}
+
+void DBFS::manifest::details::write_log(int fd, const string& data)
+{
+	size_t done = 0;
+	while(fd >= 0 && done < data.size()){
+		#ifdef _WIN32
+			int r = ::_write(fd, data.data() + done, data.size() - done);
+		#else
+			ssize_t r = ::write(fd, data.data() + done, data.size() - done);
+		#endif
+		if(r < 0 && errno == EINTR){
+			continue;
+		}
+		if(r <= 0){
+			return;
+		}
+		done += r;
+	}
+}
+
+void DBFS::manifest::details::close_log(int& fd)
+{
+	if(fd < 0){
+		return;
+	}
+	#ifdef _WIN32
+		::_close(fd);
+	#else
+		::close(fd);
+	#endif
+	fd = -1;
+}
@@ -0,0 +1,47 @@
+#ifndef DBFS_MANIFEST_H
+#define DBFS_MANIFEST_H
+
+#include "dbfs.hpp"
+
+#include <unordered_map>
+
+namespace DBFS{
+	
+	namespace manifest{
+		
+		struct entry{
+			string name;
+			pos_t size;
+		};
+		
+		// Returns true if the listing was read from the log, false if the log
+		// was missing or stale and root had to be scanned
+		bool open(string path = "", int threads = 4);
+		void close();
+		bool is_open();
+		std::vector<entry> list();
+		void compact();
+		
+		namespace details{
+			void created(const string& filename);
+			void moved(const string& oldname, const string& newname);
+			void removed(const string& filename);
+			void closed(const string& filename);
+			
+			bool load();
+			bool parse(const string& path, pos_t limit, std::unordered_map<string, pos_t>& live, size_t& records, bool& clean);
+			void scan(int threads);
+			void append(char op, pos_t size, const string& name, const string& newname = "");
+			string format(char op, pos_t size, const string& name, const string& newname);
+			void rewrite();
+			void compaction_loop();
+			void compact_log();
+			pos_t log_size(int fd);
+			int open_log(const string& path, bool truncate);
+			void write_log(int fd, const string& data);
+			void close_log(int& fd);
+		}
+	}
+}
+
+#endif // DBFS_MANIFEST_H
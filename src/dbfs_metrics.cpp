@@ -0,0 +1,152 @@
+#include "dbfs_metrics.hpp"
+
+#include <mutex>
+#include <list>
+#include <algorithm>
+
+namespace DBFS{
+	namespace metrics{
+		
+		// Written only by the owning thread, read by get_snapshot()
+		struct counter{
+			std::atomic<unsigned long long> val{0};
+			
+			void add(unsigned long long v)
+			{
+				val.store(val.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+			}
+			unsigned long long get() const
+			{
+				return val.load(std::memory_order_relaxed);
+			}
+		};
+		
+		struct thread_op_stats{
+			counter calls, bytes, failures, retries;
+			counter hist[BUCKETS];
+		};
+		
+		struct thread_stats{
+			thread_op_stats ops[OP_COUNT];
+			
+			thread_stats();
+			~thread_stats();
+		};
+		
+		std::mutex mtx;
+		std::list<thread_stats*> threads;
+		// Counts of finished threads and base values subtracted by reset()
+		op_stats retired[OP_COUNT];
+		op_stats base[OP_COUNT];
+		
+		thread_stats& local();
+		void add(op_stats& to, const op_stats& from, bool subtract = false);
+	}
+}
+
+DBFS::metrics::thread_stats::thread_stats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	threads.push_back(this);
+}
+
+DBFS::metrics::thread_stats::~thread_stats()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	threads.remove(this);
+	for(int i=0;i<OP_COUNT;i++){
+		retired[i].calls += ops[i].calls.get();
+		retired[i].bytes += ops[i].bytes.get();
+		retired[i].failures += ops[i].failures.get();
+		retired[i].retries += ops[i].retries.get();
+		for(int j=0;j<BUCKETS;j++){
+			retired[i].hist[j] += ops[i].hist[j].get();
+		}
+	}
+}
+
+DBFS::metrics::thread_stats& DBFS::metrics::local()
+{
+	thread_local thread_stats stats;
+	return stats;
+}
+
+void DBFS::metrics::record(op_t op, long long ns, long long bytes, bool failed)
+{
+	thread_op_stats& s = local().ops[op];
+	s.calls.add(1);
+	if(bytes > 0){
+		s.bytes.add(bytes);
+	}
+	if(failed){
+		s.failures.add(1);
+	}
+	int bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+	s.hist[std::min(bucket, BUCKETS - 1)].add(1);
+}
+
+void DBFS::metrics::retry(op_t op)
+{
+	local().ops[op].retries.add(1);
+}
+
+DBFS::metrics::snapshot DBFS::metrics::get_snapshot()
+{
+	snapshot snap;
+	std::lock_guard<std::mutex> lock(mtx);
+	for(int i=0;i<OP_COUNT;i++){
+		snap.ops[i] = retired[i];
+		for(auto* t : threads){
+			const thread_op_stats& s = t->ops[i];
+			snap.ops[i].calls += s.calls.get();
+			snap.ops[i].bytes += s.bytes.get();
+			snap.ops[i].failures += s.failures.get();
+			snap.ops[i].retries += s.retries.get();
+			for(int j=0;j<BUCKETS;j++){
+				snap.ops[i].hist[j] += s.hist[j].get();
+			}
+		}
+		add(snap.ops[i], base[i], true);
+	}
+	return snap;
+}
+
+void DBFS::metrics::reset()
+{
+	snapshot snap = get_snapshot();
+	std::lock_guard<std::mutex> lock(mtx);
+	for(int i=0;i<OP_COUNT;i++){
+		add(base[i], snap.ops[i]);
+	}
+}
+
+const char* DBFS::metrics::op_name(op_t op)
+{
+	static const char* names[OP_COUNT] = {"create", "open", "read", "write", "move", "remove", "exists", "lock_wait", "lock_hold"};
+	return names[op];
+}
+
+unsigned long long DBFS::metrics::op_stats::percentile(double p) const
+{
+	unsigned long long rank = calls * p;
+	unsigned long long seen = 0;
+	for(int i=0;i<BUCKETS;i++){
+		seen += hist[i];
+		if(seen > rank){
+			return i ? 1ULL << i : 0;
+		}
+	}
+	return calls ? 1ULL << (BUCKETS - 1) : 0;
+}
+
+void DBFS::metrics::add(op_stats& to, const op_stats& from, bool subtract)
+{
+	unsigned long long sign = subtract ? -1ULL : 1ULL;
+	to.calls += sign * from.calls;
+	to.bytes += sign * from.bytes;
+	to.failures += sign * from.failures;
+	to.retries += sign * from.retries;
+	for(int j=0;j<BUCKETS;j++){
+		to.hist[j] += sign * from.hist[j];
+	}
+}
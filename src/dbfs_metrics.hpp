@@ -0,0 +1,72 @@
+#ifndef DBFS_METRICS_H
+#define DBFS_METRICS_H
+
+#include <atomic>
+#include <chrono>
+
+namespace DBFS{
+	
+	namespace metrics{
+		
+		enum op_t { CREATE, OPEN, READ, WRITE, MOVE, REMOVE, EXISTS, LOCK_WAIT, LOCK_HOLD, OP_COUNT };
+		
+		// Latency histogram bucket `i` counts calls that took [2^(i-1), 2^i) ns
+		const int BUCKETS = 48;
+		
+		struct op_stats{
+			unsigned long long calls = 0;
+			unsigned long long bytes = 0;
+			unsigned long long failures = 0;
+			unsigned long long retries = 0;
+			unsigned long long hist[BUCKETS] = {};
+			
+			unsigned long long percentile(double p) const;
+		};
+		
+		struct snapshot{
+			op_stats ops[OP_COUNT];
+			
+			const op_stats& operator[](op_t op) const { return ops[op]; }
+		};
+		
+		snapshot get_snapshot();
+		void reset();
+		const char* op_name(op_t op);
+		
+		void record(op_t op, long long ns, long long bytes, bool failed);
+		void retry(op_t op);
+		
+		// Records the call when it goes out of scope. Paths that leave
+		// without calling done() are counted as failures
+		class timer{
+			public:
+				timer(op_t op) : op(op), start(std::chrono::steady_clock::now()) {}
+				~timer()
+				{
+					record(op, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), bytes, failed);
+				}
+				void done(long long bytes, bool failed)
+				{
+					this->bytes = bytes;
+					this->failed = failed;
+				}
+			private:
+				op_t op;
+				std::chrono::steady_clock::time_point start;
+				long long bytes = 0;
+				bool failed = true;
+		};
+	}
+}
+
+#ifdef DBFS_METRICS
+	#define DBFS_METRIC_START(name, op) DBFS::metrics::timer name(DBFS::metrics::op)
+	#define DBFS_METRIC_DONE(name, bytes, failed) name.done((bytes), (failed))
+	#define DBFS_METRIC_RETRY(op) DBFS::metrics::retry(DBFS::metrics::op)
+#else
+	#define DBFS_METRIC_START(name, op)
+	#define DBFS_METRIC_DONE(name, bytes, failed)
+	#define DBFS_METRIC_RETRY(op)
+#endif
+
+#endif // DBFS_METRICS_H
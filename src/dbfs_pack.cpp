@@ -0,0 +1,624 @@
+#include "dbfs_pack.hpp"
+
+#include <map>
+#include <unordered_map>
+
+namespace DBFS{
+	namespace pack{
+		
+		// Segment is a sequence of records: header, name, data. PUT stores a new
+		// version of the object, DEL marks it removed. Replaying segments in id
+		// order rebuilds the index, the last record of a name wins
+		const uint32_t magic = 0x4B504244;
+		
+		std::atomic<bool> on{false};
+		
+		// Built on first use, like the manifest state
+		struct state_t{
+			std::shared_mutex mtx;
+			string dir;
+			pos_t segment_size = 0;
+			std::unordered_map<string, details::extent> index;
+			std::map<uint32_t, details::segment> segments;
+			uint32_t active = 0;
+			
+			std::mutex cmtx;
+			std::condition_variable cv;
+			std::thread compactor;
+			bool stop = false;
+		};
+		state_t& state();
+		
+		// Joins compaction thread and closes segments before static destruction
+		struct guard_t{
+			guard_t(){ state(); }
+			~guard_t(){ stop_compaction(); close(); }
+		} guard;
+	}
+}
+
+DBFS::pack::state_t& DBFS::pack::state()
+{
+	static state_t st;
+	return st;
+}
+
+bool DBFS::pack::open(string dir, pos_t segment_size)
+{
+	close();
+	state_t& st = state();
+	std::unique_lock<std::shared_mutex> lock(st.mtx);
+	st.dir = dir.empty() ? root + "/.pack" : dir;
+	st.segment_size = segment_size;
+	DBFS::details::create_path(st.dir + "/");
+	
+	std::vector<string> files;
+	DBFS::details::list_dir(st.dir, files, false);
+	for(auto& it : files){
+		string base = it.substr(st.dir.size() + 1);
+		if(base.size() != 12 || base.compare(8, 4, ".seg") != 0){
+			continue;
+		}
+		uint32_t id = std::strtoul(base.c_str(), nullptr, 16);
+		#ifdef _WIN32
+			st.segments[id].fd = ::_open(it.c_str(), _O_RDWR | _O_BINARY);
+		#else
+			st.segments[id].fd = ::open(it.c_str(), O_RDWR | O_CLOEXEC);
+		#endif
+	}
+	for(auto& it : st.segments){
+		if(it.second.fd < 0 || !details::replay(it.first)){
+			for(auto& seg : st.segments){
+				if(seg.second.fd >= 0){
+					#ifdef _WIN32
+						::_close(seg.second.fd);
+					#else
+						::close(seg.second.fd);
+					#endif
+				}
+			}
+			st.segments.clear();
+			st.index.clear();
+			return false;
+		}
+	}
+	// Appends continue in the last segment while it has room
+	if(st.segments.empty() || st.segments.rbegin()->second.end >= st.segment_size){
+		details::roll();
+	}
+	else{
+		st.active = st.segments.rbegin()->first;
+	}
+	on = true;
+	return true;
+}
+
+void DBFS::pack::close()
+{
+	state_t& st = state();
+	std::unique_lock<std::shared_mutex> lock(st.mtx);
+	on = false;
+	for(auto& it : st.segments){
+		#ifdef _WIN32
+			::_close(it.second.fd);
+		#else
+			::close(it.second.fd);
+		#endif
+	}
+	st.segments.clear();
+	st.index.clear();
+	st.active = 0;
+}
+
+bool DBFS::pack::is_open()
+{
+	return on;
+}
+
+bool DBFS::pack::exists(string name)
+{
+	state_t& st = state();
+	std::shared_lock<std::shared_mutex> lock(st.mtx);
+	return st.index.count(name);
+}
+
+bool DBFS::pack::move(string oldname, string newname)
+{
+	state_t& st = state();
+	std::unique_lock<std::shared_mutex> lock(st.mtx);
+	string data;
+	// New name goes first, crash in between leaves both rather than none
+	if(!details::get(oldname, data) || !details::append(details::PUT, newname, data)){
+		return false;
+	}
+	return details::append(details::DEL, oldname, "");
+}
+
+bool DBFS::pack::remove(string name)
+{
+	state_t& st = state();
+	std::unique_lock<std::shared_mutex> lock(st.mtx);
+	if(!st.index.count(name)){
+		return false;
+	}
+	return details::append(details::DEL, name, "");
+}
+
+std::vector<DBFS::string> DBFS::pack::list()
+{
+	state_t& st = state();
+	std::shared_lock<std::shared_mutex> lock(st.mtx);
+	std::vector<string> ret;
+	ret.reserve(st.index.size());
+	for(auto& it : st.index){
+		ret.push_back(it.first);
+	}
+	return ret;
+}
+
+int DBFS::pack::compact(double ratio)
+{
+	state_t& st = state();
+	std::vector<uint32_t> ids;
+	{
+		std::shared_lock<std::shared_mutex> lock(st.mtx);
+		for(auto& it : st.segments){
+			if(it.first != st.active && it.second.live < ratio * it.second.end){
+				ids.push_back(it.first);
+			}
+		}
+	}
+	// One segment at a time, so readers wait for a single segment copy at most
+	int count = 0;
+	for(auto id : ids){
+		std::unique_lock<std::shared_mutex> lock(st.mtx);
+		if(on && st.segments.count(id) && details::compact_segment(id)){
+			count++;
+		}
+	}
+	return count;
+}
+
+void DBFS::pack::start_compaction(double ratio, int interval_ms)
+{
+	state_t& st = state();
+	std::lock_guard<std::mutex> lock(st.cmtx);
+	if(st.compactor.joinable()){
+		return;
+	}
+	st.stop = false;
+	st.compactor = std::thread(details::compaction_loop, ratio, interval_ms);
+}
+
+void DBFS::pack::stop_compaction()
+{
+	state_t& st = state();
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> lock(st.cmtx);
+		st.stop = true;
+		t = std::move(st.compactor);
+	}
+	st.cv.notify_all();
+	if(t.joinable()){
+		t.join();
+	}
+}
+
+void DBFS::pack::details::compaction_loop(double ratio, int interval_ms)
+{
+	#if defined(__linux__)
+		// Lowest priority for this thread only, elsewhere it would be the process
+		::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), 19);
+	#endif
+	state_t& st = state();
+	std::unique_lock<std::mutex> lock(st.cmtx);
+	while(!st.stop){
+		st.cv.wait_for(lock, std::chrono::milliseconds(interval_ms));
+		if(st.stop){
+			break;
+		}
+		lock.unlock();
+		compact(ratio);
+		lock.lock();
+	}
+}
+
+DBFS::pack::File::File()
+{
+	// ctor
+}
+
+DBFS::pack::File::File(string name)
+{
+	open(name);
+}
+
+DBFS::pack::File::~File()
+{
+	close();
+}
+
+bool DBFS::pack::File::open(string name)
+{
+	close();
+	filename = name;
+	return open();
+}
+
+bool DBFS::pack::File::open()
+{
+	if(opened){
+		close();
+	}
+	string data;
+	{
+		std::shared_lock<std::shared_mutex> lock(state().mtx);
+		if(!on){
+			return false;
+		}
+		// Missing object is created, same as DBFS::File does with files, but
+		// only by the first flush, an empty version would race with other ones
+		dirty = !details::get(filename, data);
+	}
+	st.str(data);
+	st.clear();
+	st.seekg(0);
+	st.seekp(0);
+	opened = true;
+	return true;
+}
+
+void DBFS::pack::File::close()
+{
+	if(!opened){
+		return;
+	}
+	flush();
+	opened = false;
+	st.str("");
+	st.clear();
+}
+
+bool DBFS::pack::File::flush()
+{
+	if(!opened || !dirty){
+		return true;
+	}
+	dirty = false;
+	return details::put(filename, st.str());
+}
+
+void DBFS::pack::File::write(const char* val, pos_t size)
+{
+	st.write(val, size);
+	dirty = true;
+}
+
+void DBFS::pack::File::read(char* val, pos_t size)
+{
+	st.read(val, size);
+}
+
+void DBFS::pack::File::seekp(pos_t p)
+{
+	st.clear();
+	st.seekp(p);
+}
+
+void DBFS::pack::File::seekg(pos_t p)
+{
+	st.clear();
+	st.seekg(p);
+}
+
+DBFS::pos_t DBFS::pack::File::tellp()
+{
+	return st.tellp();
+}
+
+DBFS::pos_t DBFS::pack::File::tellg()
+{
+	return st.tellg();
+}
+
+DBFS::pos_t DBFS::pack::File::size()
+{
+	// Measured on the buffer directly, stream may be in eof state after a read
+	auto buf = st.rdbuf();
+	pos_t g = buf->pubseekoff(0, std::ios::cur, std::ios::in);
+	pos_t size = buf->pubseekoff(0, std::ios::end, std::ios::in);
+	buf->pubseekpos(g, std::ios::in);
+	return size;
+}
+
+DBFS::string DBFS::pack::File::name()
+{
+	return filename;
+}
+
+bool DBFS::pack::File::move(string newname)
+{
+	flush();
+	if(!pack::move(filename, newname)){
+		return false;
+	}
+	filename = newname;
+	return true;
+}
+
+bool DBFS::pack::File::remove()
+{
+	dirty = false;
+	bool r = pack::remove(filename);
+	opened = false;
+	st.str("");
+	st.clear();
+	return r;
+}
+
+bool DBFS::pack::File::is_open()
+{
+	return opened;
+}
+
+bool DBFS::pack::File::fail()
+{
+	return st.fail();
+}
+
+DBFS::pack::File* DBFS::pack::create()
+{
+	return create(DBFS::random_filename());
+}
+
+DBFS::pack::File* DBFS::pack::create(string name)
+{
+	return new File(name);
+}
+
+bool DBFS::pack::details::get(const string& name, string& data)
+{
+	state_t& st = state();
+	auto it = st.index.find(name);
+	if(it == st.index.end()){
+		return false;
+	}
+	// Only the shared lock is held, the segment map must not be changed
+	auto seg = st.segments.find(it->second.seg);
+	if(seg == st.segments.end()){
+		return false;
+	}
+	data.resize(it->second.size);
+	return pread(seg->second.fd, it->second.offset, &data[0], data.size()) == (pos_t)data.size();
+}
+
+bool DBFS::pack::details::put(const string& name, const string& data)
+{
+	state_t& st = state();
+	std::unique_lock<std::shared_mutex> lock(st.mtx);
+	return on && append(PUT, name, data);
+}
+
+bool DBFS::pack::details::append(record_t type, const string& name, const string& data)
+{
+	state_t& st = state();
+	pos_t rec = sizeof(header) + name.size() + data.size();
+	if(st.segments[st.active].end > 0 && st.segments[st.active].end + rec > st.segment_size){
+		roll();
+	}
+	segment& seg = st.segments[st.active];
+	
+	header h{magic, 0, type, (uint32_t)name.size(), (uint32_t)data.size()};
+	h.crc = checksum(h, name.data(), data.data());
+	string buf;
+	buf.reserve(rec);
+	buf.append((const char*)&h, sizeof(h));
+	buf.append(name);
+	buf.append(data);
+	if(pwrite(seg.fd, seg.end, buf.data(), buf.size()) != rec){
+		return false;
+	}
+	
+	auto it = st.index.find(name);
+	if(it != st.index.end()){
+		st.segments[it->second.seg].live -= sizeof(header) + name.size() + it->second.size;
+		st.index.erase(it);
+	}
+	if(type == PUT){
+		st.index[name] = {st.active, seg.end + (pos_t)sizeof(header) + (pos_t)name.size(), (pos_t)data.size()};
+		seg.live += rec;
+	}
+	seg.end += rec;
+	return true;
+}
+
+bool DBFS::pack::details::replay(uint32_t id)
+{
+	state_t& st = state();
+	segment& seg = st.segments[id];
+	string buf;
+	pos_t size;
+	#ifdef _WIN32
+		size = ::_lseeki64(seg.fd, 0, SEEK_END);
+	#else
+		size = ::lseek(seg.fd, 0, SEEK_END);
+	#endif
+	buf.resize(size);
+	if(pread(seg.fd, 0, &buf[0], size) != size){
+		return false;
+	}
+	
+	pos_t pos = 0;
+	while(pos + (pos_t)sizeof(header) <= size){
+		header h;
+		std::memcpy(&h, &buf[pos], sizeof(h));
+		pos_t rec = sizeof(header) + (pos_t)h.name_size + h.data_size;
+		const char* name = &buf[pos + sizeof(header)];
+		if(h.magic != magic || pos + rec > size || h.crc != checksum(h, name, name + h.name_size)){
+			// Torn write at the tail, everything after it is dropped
+			break;
+		}
+		string key(name, h.name_size);
+		auto it = st.index.find(key);
+		if(it != st.index.end()){
+			st.segments[it->second.seg].live -= sizeof(header) + h.name_size + it->second.size;
+			st.index.erase(it);
+		}
+		if(h.type == PUT){
+			st.index[key] = {id, pos + (pos_t)sizeof(header) + h.name_size, (pos_t)h.data_size};
+			seg.live += rec;
+		}
+		pos += rec;
+	}
+	seg.end = pos;
+	if(pos < size){
+		#ifdef _WIN32
+			::_chsize_s(seg.fd, pos);
+		#else
+			if(::ftruncate(seg.fd, pos) != 0){
+				return false;
+			}
+		#endif
+	}
+	return true;
+}
+
+bool DBFS::pack::details::compact_segment(uint32_t id)
+{
+	state_t& st = state();
+	segment seg = st.segments[id];
+	string buf(seg.end, '\0');
+	if(pread(seg.fd, 0, &buf[0], seg.end) != seg.end){
+		return false;
+	}
+	// Tombstones must outlive older segments that may still hold the name
+	bool oldest = st.segments.begin()->first == id;
+	uint32_t first = st.active;
+	
+	pos_t pos = 0;
+	while(pos < seg.end){
+		header h;
+		std::memcpy(&h, &buf[pos], sizeof(h));
+		pos_t rec = sizeof(header) + (pos_t)h.name_size + h.data_size;
+		string name(&buf[pos + sizeof(header)], h.name_size);
+		pos_t offset = pos + sizeof(header) + h.name_size;
+		auto it = st.index.find(name);
+		if(h.type == PUT && it != st.index.end() && it->second.seg == id && it->second.offset == offset){
+			if(!append(PUT, name, buf.substr(offset, h.data_size))){
+				return false;
+			}
+		}
+		else if(h.type == DEL && !oldest && it == st.index.end()){
+			if(!append(DEL, name, "")){
+				return false;
+			}
+		}
+		pos += rec;
+	}
+	
+	// Copies have to be durable before the only other copy is gone. Segments
+	// rolled during the copy need their directory entries synced too
+	for(auto it = st.segments.lower_bound(first); it != st.segments.end(); ++it){
+		if(it->first != id && !sync(it->second.fd)){
+			return false;
+		}
+	}
+	if(!DBFS::details::sync_path(st.dir)){
+		return false;
+	}
+	#ifdef _WIN32
+		::_close(seg.fd);
+	#else
+		::close(seg.fd);
+	#endif
+	st.segments.erase(id);
+	std::remove(segment_path(id).c_str());
+	return true;
+}
+
+bool DBFS::pack::details::sync(int fd)
+{
+	#if defined(_WIN32)
+		return ::_commit(fd) == 0;
+	#elif defined(__linux__)
+		return ::fdatasync(fd) == 0;
+	#else
+		return ::fsync(fd) == 0;
+	#endif
+}
+
+void DBFS::pack::details::roll()
+{
+	state_t& st = state();
+	uint32_t id = st.segments.empty() ? 1 : st.segments.rbegin()->first + 1;
+	segment seg;
+	#ifdef _WIN32
+		seg.fd = ::_open(segment_path(id).c_str(), _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+	#else
+		seg.fd = ::open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	#endif
+	st.segments[id] = seg;
+	st.active = id;
+}
+
+DBFS::string DBFS::pack::details::segment_path(uint32_t id)
+{
+	char name[16];
+	std::snprintf(name, sizeof(name), "%08x.seg", id);
+	return state().dir + "/" + name;
+}
+
+uint32_t DBFS::pack::details::checksum(const header& h, const char* name, const char* data)
+{
+	header tmp = h;
+	tmp.crc = 0;
+	string buf((const char*)&tmp, sizeof(tmp));
+	buf.append(name, h.name_size);
+	buf.append(data, h.data_size);
+	return DBFS::details::crc32(buf.data(), buf.size());
+}
+
+DBFS::pos_t DBFS::pack::details::pread(int fd, pos_t offset, char* val, pos_t size)
+{
+	pos_t done = 0;
+	while(done < size){
+		#ifdef _WIN32
+			static std::mutex mtx;
+			std::lock_guard<std::mutex> lock(mtx);
+			::_lseeki64(fd, offset + done, SEEK_SET);
+			int r = ::_read(fd, val + done, size - done);
+		#else
+			ssize_t r = ::pread(fd, val + done, size - done, offset + done);
+		#endif
+		if(r < 0 && errno == EINTR){
+			continue;
+		}
+		if(r <= 0){
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+DBFS::pos_t DBFS::pack::details::pwrite(int fd, pos_t offset, const char* val, pos_t size)
+{
+	pos_t done = 0;
+	while(done < size){
+		#ifdef _WIN32
+			::_lseeki64(fd, offset + done, SEEK_SET);
+			int r = ::_write(fd, val + done, size - done);
+		#else
+			ssize_t r = ::pwrite(fd, val + done, size - done, offset + done);
+		#endif
+		if(r < 0 && errno == EINTR){
+			continue;
+		}
+		if(r <= 0){
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
@@ -0,0 +1,126 @@
+#ifndef DBFS_PACK_H
+#define DBFS_PACK_H
+
+#include "dbfs.hpp"
+
+#include <sstream>
+
+namespace DBFS{
+	
+	// Small objects packed as records into large append-only segment files
+	namespace pack{
+		
+		bool open(string dir = "", pos_t segment_size = 64 << 20);
+		void close();
+		bool is_open();
+		
+		bool exists(string name);
+		bool move(string oldname, string newname);
+		bool remove(string name);
+		std::vector<string> list();
+		
+		// Rewrites sealed segments with less than `ratio` of live bytes
+		int compact(double ratio = 0.5);
+		void start_compaction(double ratio = 0.5, int interval_ms = 1000);
+		void stop_compaction();
+		
+		class File{
+			public:
+				File();
+				File(string name);
+				virtual ~File();
+				
+				template<typename T>
+				void write(T val);
+				
+				template<typename T>
+				void read(T& val);
+				
+				void write(const char* val, pos_t size);
+				void read(char* val, pos_t size);
+				
+				bool open();
+				bool open(string name);
+				void close();
+				bool flush();
+				
+				void seekp(pos_t p);
+				void seekg(pos_t p);
+				
+				pos_t tellp();
+				pos_t tellg();
+				
+				pos_t size();
+				
+				string name();
+				
+				bool move(string newname);
+				bool remove();
+				
+				bool is_open();
+				bool fail();
+			
+			private:
+				std::stringstream st;
+				string filename = "";
+				bool opened = false;
+				bool dirty = false;
+		};
+		
+		File* create();
+		File* create(string name);
+		
+		namespace details{
+			
+			enum record_t : uint32_t { PUT = 1, DEL = 2 };
+			
+			struct header{
+				uint32_t magic;
+				uint32_t crc;
+				uint32_t type;
+				uint32_t name_size;
+				uint32_t data_size;
+			};
+			
+			struct extent{
+				uint32_t seg;
+				pos_t offset;
+				pos_t size;
+			};
+			
+			struct segment{
+				int fd = -1;
+				pos_t end = 0;
+				pos_t live = 0;
+			};
+			
+			bool get(const string& name, string& data);
+			bool put(const string& name, const string& data);
+			bool append(record_t type, const string& name, const string& data);
+			bool replay(uint32_t id);
+			bool compact_segment(uint32_t id);
+			void roll();
+			bool sync(int fd);
+			string segment_path(uint32_t id);
+			uint32_t checksum(const header& h, const char* name, const char* data);
+			pos_t pread(int fd, pos_t offset, char* val, pos_t size);
+			pos_t pwrite(int fd, pos_t offset, const char* val, pos_t size);
+			void compaction_loop(double ratio, int interval_ms);
+		}
+	}
+}
+
+template<typename T>
+void DBFS::pack::File::read(T& val)
+{
+	st >> val;
+}
+
+template<typename T>
+void DBFS::pack::File::write(T val)
+{
+	st << val;
+	dirty = true;
+}
+
+#endif // DBFS_PACK_H
@@ -6,8 +6,12 @@
 #include <mutex>
 #include <thread>
 #include <unordered_set>
+#include <map>
 #include "qtest.hpp"
 #include "dbfs.hpp"
+#include "dbfs_async.hpp"
+#include "dbfs_manifest.hpp"
+#include "dbfs_pack.hpp"
 
 using namespace std;
 
@@ -274,6 +278,1328 @@ DESCRIBE("DBFS", {
 		});
 	});
 	
+	DESCRIBE("Positional read_at/write_at", {
+		DBFS::File* f;
+		
+		BEFORE_ALL({
+			f = DBFS::create();
+			f->write_at(0, "0123456789", 10);
+			f->write_at(4, "ab", 2);
+		});
+		
+		AFTER_ALL({
+			f->remove();
+			delete f;
+		});
+		
+		IT("should read written data at offset", {
+			char buf[10];
+			EXPECT(f->read_at(2, buf, 4)).toBe(4);
+			EXPECT(string(buf, 4)).toBe("23ab");
+		});
+		
+		IT("should return number of bytes read before end of file", {
+			char buf[10];
+			EXPECT(f->read_at(8, buf, 10)).toBe(2);
+		});
+		
+		IT("should not move read pointer", {
+			char buf[10];
+			f->seekg(1);
+			f->read_at(5, buf, 3);
+			char c;
+			f->read(c);
+			EXPECT(c).toBe('1');
+		});
+		
+		IT("should read from many threads without locking", {
+			std::atomic<int> failed{0};
+			vector<thread> v;
+			for(int i=0;i<8;i++){
+				v.emplace_back([&f, &failed](){
+					char buf[2];
+					for(int j=0;j<1000;j++){
+						if(f->read_at(j%9, buf, 2) != 2 || buf[0] == buf[1]){
+							failed++;
+						}
+					}
+				});
+			}
+			for(auto& it : v){
+				it.join();
+			}
+			EXPECT(failed.load()).toBe(0);
+		});
+	});
+	
+	DESCRIBE("Vectored readv/writev", {
+		DBFS::File* f;
+		
+		BEFORE_ALL({
+			f = DBFS::create();
+		});
+		
+		AFTER_ALL({
+			f->remove();
+			delete f;
+		});
+		
+		IT("writev should write all buffers and move write pointer", {
+			char h[] = "hdr:", k[] = "key=", v[] = "value;";
+			EXPECT(f->writev({{h, 4}, {k, 4}, {v, 6}})).toBe(14);
+			EXPECT(f->tellp()).toBe(14);
+			f->write("tail");
+			EXPECT(f->size()).toBe(18);
+		});
+		
+		IT("readv should scatter data and move read pointer", {
+			char a[3], b[5];
+			f->seekg(1);
+			EXPECT(f->readv({{a, 3}, {b, 5}})).toBe(8);
+			EXPECT(string(a, 3) + "|" + string(b, 5)).toBe("dr:|key=v");
+			char c;
+			f->read(c);
+			EXPECT(c).toBe('a');
+		});
+		
+		IT("readv_at should stop at the end of file", {
+			char a[2], b[8];
+			EXPECT(f->readv_at(14, {{a, 2}, {b, 8}})).toBe(4);
+			EXPECT(string(a, 2) + string(b, 2)).toBe("tail");
+		});
+		
+		IT("writev_at should not move pointers", {
+			char x[] = "XY";
+			f->seekg(0);
+			EXPECT(f->writev_at(4, {{x, 1}, {x+1, 1}})).toBe(2);
+			char c;
+			f->read(c);
+			EXPECT(c).toBe('h');
+			char buf[4];
+			f->read_at(3, buf, 4);
+			EXPECT(string(buf, 4)).toBe(":XYy");
+		});
+	});
+	
+	DESCRIBE("Memory mapped file", {
+		DBFS::File* f;
+		
+		BEFORE_ALL({
+			f = DBFS::create();
+			f->write("0123456789");
+			f->stream().flush();
+			f->map();
+		});
+		
+		AFTER_ALL({
+			f->remove();
+			delete f;
+		});
+		
+		IT("should be mapped", {
+			EXPECT(f->is_mapped()).toBe(true);
+		});
+		
+		IT("view should point to file content", {
+			EXPECT(string(f->view(2, 3))).toBe("234");
+		});
+		
+		IT("view should be clamped to the end of file", {
+			EXPECT(f->view(8, 10).size()).toBe(2);
+		});
+		
+		IT("write_at past the end should grow the file", {
+			EXPECT(f->write_at(8, "abcd", 4)).toBe(4);
+			EXPECT(f->msync()).toBe(true);
+			EXPECT(string(f->view(6, 6))).toBe("67abcd");
+			EXPECT(f->size()).toBe(12);
+		});
+		
+		IT("writes through the map should be visible to the stream", {
+			f->write_at(100000, "x", 1);
+			f->seekg(100000);
+			char c;
+			f->read(c);
+			EXPECT(c).toBe('x');
+		});
+		
+		IT("write_at should not cut data written through the stream", {
+			string tail(10000, 'z');
+			f->seekp(f->size());
+			f->write(&tail[0], tail.size());
+			f->flush();
+			DBFS::pos_t size = f->size();
+			f->write_at(size - 5000, "y", 1);
+			EXPECT(f->size()).toBe(size);
+		});
+		
+		IT("should not be mapped after close", {
+			f->close();
+			EXPECT(f->is_mapped()).toBe(false);
+			f->open();
+		});
+	});
+	
+	DESCRIBE("Async engine", {
+		DBFS::File* f;
+		
+		BEFORE_ALL({
+			f = DBFS::async::create().get();
+		});
+		
+		AFTER_ALL({
+			f->remove();
+			delete f;
+		});
+		
+		IT("should create file", {
+			EXPECT(f != nullptr).toBe(true);
+			EXPECT(DBFS::exists(f->name())).toBe(true);
+			INFO_PRINT(DBFS::async::uses_io_uring() ? "io_uring" : "thread pool");
+		});
+		
+		IT("should write and read data with many requests in flight", {
+			vector<future<DBFS::pos_t>> writes;
+			for(int i=0;i<32;i++){
+				writes.push_back(DBFS::async::write(f, i*4, "abcd", 4));
+			}
+			bool ok = true;
+			for(auto& it : writes){
+				ok = ok && it.get() == 4;
+			}
+			EXPECT(ok).toBe(true);
+			EXPECT(DBFS::async::fsync(f).get()).toBe(0);
+			char buf[128];
+			EXPECT(DBFS::async::read(f, 0, buf, 128).get()).toBe(128);
+			EXPECT(string(buf+124, 4)).toBe("abcd");
+		});
+		
+		IT("should run callbacks", {
+			std::promise<DBFS::pos_t> p;
+			char buf[4];
+			DBFS::async::read(f, 4, buf, 4, [&p](DBFS::pos_t res){ p.set_value(res); });
+			EXPECT(p.get_future().get()).toBe(4);
+		});
+		
+		IT("should let callbacks submit more requests at queue depth 1", {
+			DBFS::async::stop();
+			DBFS::async::start(1, 1);
+			std::promise<DBFS::pos_t> p;
+			char a[4], b[4];
+			DBFS::async::read(f, 0, a, 4, [&](DBFS::pos_t res){
+				DBFS::async::read(f, 4, b, 4, [&p, res](DBFS::pos_t res2){ p.set_value(res + res2); });
+			});
+			auto done = p.get_future();
+			bool ready = done.wait_for(chrono::seconds(5)) == future_status::ready;
+			EXPECT(ready).toBe(true);
+			if(ready){
+				EXPECT(done.get()).toBe(8);
+				DBFS::async::stop();
+				DBFS::async::start();
+			}
+		});
+		
+		IT("should move and remove files", {
+			string name = DBFS::random_filename();
+			string newname = DBFS::random_filename();
+			DBFS::async::open(name).get()->close();
+			EXPECT(DBFS::async::move(name, newname).get()).toBe(true);
+			EXPECT(DBFS::exists(name)).toBe(false);
+			EXPECT(DBFS::exists(newname)).toBe(true);
+			EXPECT(DBFS::async::remove(newname).get()).toBe(true);
+			EXPECT(DBFS::exists(newname)).toBe(false);
+		});
+	});
+	
+	DESCRIBE("File descriptor pool", {
+		int open_count, close_count;
+		open_count = close_count = 0;
+		vector<DBFS::File*> files;
+		
+		BEFORE_ALL({
+			DBFS::set_max_open_files(2);
+			for(int i=0;i<5;i++){
+				auto* f = DBFS::create([&open_count](auto* file){ open_count++; }, [&close_count](auto* file){ close_count++; });
+				f->write("file" + to_string(i));
+				files.push_back(f);
+			}
+		});
+		
+		AFTER_ALL({
+			for(auto* f : files){
+				f->remove();
+				delete f;
+			}
+			DBFS::set_max_open_files(0);
+		});
+		
+		IT("should keep no more than 2 descriptors open", {
+			EXPECT(DBFS::get_open_files()).toBeLessThanOrEqual(2);
+		});
+		
+		IT("evicted files should still be reported as opened", {
+			for(auto* f : files){
+				EXPECT(f->is_open()).toBe(true);
+			}
+		});
+		
+		IT("evicted files should be reopened transparently on read", {
+			for(int i=0;i<5;i++){
+				string expected = "file" + to_string(i);
+				char buf[16];
+				files[i]->seekg(0);
+				files[i]->read(buf, expected.size());
+				EXPECT(string(buf, expected.size())).toBe(expected);
+			}
+			EXPECT(DBFS::get_open_files()).toBeLessThanOrEqual(2);
+		});
+		
+		IT("read_at should work with evicted files", {
+			char buf[16];
+			for(int i=4;i>=0;i--){
+				EXPECT(files[i]->read_at(4, buf, 1)).toBe(1);
+				EXPECT(buf[0]).toBe((char)('0' + i));
+			}
+			EXPECT(DBFS::get_open_files()).toBeLessThanOrEqual(2);
+		});
+		
+		IT("should count stream and positional descriptors against the limit", {
+			DBFS::set_max_open_files(4);
+			char buf[16];
+			for(auto* f : files){
+				f->size();
+				f->read_at(0, buf, 1);
+			}
+			EXPECT(DBFS::get_open_files()).toBeLessThanOrEqual(4);
+			#ifdef __linux__
+			unordered_set<string> paths;
+			for(auto* f : files){
+				char* real = realpath(DBFS::get_file_path(f->name()).c_str(), nullptr);
+				paths.insert(real);
+				free(real);
+			}
+			int fds = 0;
+			for(int d=0;d<4096;d++){
+				char link[PATH_MAX];
+				ssize_t len = readlink(("/proc/self/fd/" + to_string(d)).c_str(), link, sizeof(link));
+				if(len > 0 && paths.count(string(link, len))){
+					fds++;
+				}
+			}
+			EXPECT(fds).toBeLessThanOrEqual(4);
+			#endif
+			DBFS::set_max_open_files(2);
+			EXPECT(DBFS::get_open_files()).toBeLessThanOrEqual(2);
+		});
+		
+		IT("evicted files should keep write position", {
+			files[0]->write("!");
+			EXPECT(files[0]->size()).toBe(6);
+		});
+		
+		IT("evictions should not run on_open/on_close hooks", {
+			EXPECT(open_count).toBe(5);
+			EXPECT(close_count).toBe(0);
+		});
+	});
+	
+	DESCRIBE("Operation metrics", {
+		DBFS::metrics::snapshot snap;
+		
+		BEFORE_ALL({
+			DBFS::metrics::reset();
+			DBFS::File* f = DBFS::create();
+			char buf[5] = {'a','b','c','d','e'};
+			f->write(buf, 5);
+			f->seekg(0);
+			f->read(buf, 5);
+			f->read_at(0, buf, 5);
+			string name = DBFS::random_filename();
+			f->move(name);
+			DBFS::exists(name);
+			f->remove();
+			DBFS::remove(name);
+			delete f;
+			snap = DBFS::metrics::get_snapshot();
+		});
+		
+		IT("should count calls of every operation", {
+			EXPECT(snap[DBFS::metrics::CREATE].calls).toBe(1ULL);
+			EXPECT(snap[DBFS::metrics::OPEN].calls).toBe(2ULL);
+			EXPECT(snap[DBFS::metrics::WRITE].calls).toBe(1ULL);
+			EXPECT(snap[DBFS::metrics::READ].calls).toBe(2ULL);
+			EXPECT(snap[DBFS::metrics::MOVE].calls).toBe(1ULL);
+			EXPECT(snap[DBFS::metrics::REMOVE].calls).toBe(2ULL);
+			EXPECT(snap[DBFS::metrics::EXISTS].calls).toBeGreaterThanOrEqual(1ULL);
+		});
+		
+		IT("should count bytes", {
+			EXPECT(snap[DBFS::metrics::WRITE].bytes).toBe(5ULL);
+			EXPECT(snap[DBFS::metrics::READ].bytes).toBe(10ULL);
+		});
+		
+		IT("should count failures", {
+			EXPECT(snap[DBFS::metrics::REMOVE].failures).toBe(1ULL);
+			EXPECT(snap[DBFS::metrics::READ].failures).toBe(0ULL);
+		});
+		
+		IT("should fill latency histogram", {
+			EXPECT(snap[DBFS::metrics::READ].percentile(0.5)).toBeGreaterThan(0ULL);
+			INFO_PRINT("open p50 <= " + to_string(snap[DBFS::metrics::OPEN].percentile(0.5)) + "ns");
+		});
+		
+		IT("should drop counters on reset", {
+			DBFS::metrics::reset();
+			EXPECT(DBFS::metrics::get_snapshot()[DBFS::metrics::READ].calls).toBe(0ULL);
+		});
+	});
+	
+	DESCRIBE("Directory fan-out", {
+		std::vector<string> names;
+		
+		BEFORE_ALL({
+			for(int i=0;i<50;i++){
+				names.push_back(DBFS::random_filename());
+				DBFS::File* f = DBFS::create(names.back());
+				f->write(&names.back()[0], names.back().size());
+				delete f;
+			}
+		});
+		
+		AFTER_ALL({
+			for(auto& it : names){
+				DBFS::remove(it);
+			}
+			DBFS::set_dir_levels(2, 2);
+		});
+		
+		IT("should place files by levels and width", {
+			DBFS::set_dir_levels(3, 1);
+			EXPECT(DBFS::get_file_path("abcdef")).toBe("tmp/a/b/c/abcdef");
+			DBFS::set_dir_levels(0, 2);
+			EXPECT(DBFS::get_file_path("abcdef")).toBe("tmp/abcdef");
+			DBFS::set_dir_levels(2, 2);
+			string path;
+			DBFS::get_file_path("abcdef", path);
+			EXPECT(path).toBe("tmp/ab/cd/abcdef");
+		});
+		
+		IT("reshard should move every file to the new layout", {
+			DBFS::set_dir_levels(3, 1);
+			EXPECT(DBFS::reshard(2, 2)).toBeGreaterThanOrEqual(50L);
+			bool ok = true;
+			for(auto& it : names){
+				DBFS::File f(it);
+				string s(it.size(), ' ');
+				f.read(&s[0], s.size());
+				ok = ok && f.is_open() && s == it;
+			}
+			EXPECT(ok).toBe(true);
+		});
+		
+		IT("reshard back should restore old layout", {
+			DBFS::set_dir_levels(2, 2);
+			EXPECT(DBFS::reshard(3, 1, 2)).toBeGreaterThanOrEqual(50L);
+			EXPECT(DBFS::exists(names[0])).toBe(true);
+		});
+	});
+	
+	DESCRIBE("Known directory cache", {
+		IT("should remember directories created for a file", {
+			DBFS::create("qzcache1")->close();
+			EXPECT(DBFS::details::dir_known("tmp/qz/ca")).toBe(true);
+		});
+		
+		IT("should forget directories removed with the file", {
+			DBFS::remove("qzcache1");
+			EXPECT(DBFS::details::dir_known("tmp/qz/ca")).toBe(false);
+		});
+		
+		IT("should recreate directories removed behind its back", {
+			DBFS::create("qzcache1")->close();
+			DBFS::remove("qzcache1", false);
+			DBFS::details::rmdir("tmp/qz/ca");
+			DBFS::details::rmdir("tmp/qz");
+			DBFS::File* f = DBFS::create("qzcache1");
+			EXPECT(f->is_open()).toBe(true);
+			EXPECT(DBFS::exists("qzcache1")).toBe(true);
+			delete f;
+			DBFS::remove("qzcache1");
+		});
+	});
+	
+	DESCRIBE("Background directory reaper", {
+		struct stat sb;
+		
+		BEFORE_ALL({
+			DBFS::start_reaper(100000);
+			for(int i=0;i<20;i++){
+				DBFS::create("qr" + to_string(i) + "reaper")->close();
+			}
+		});
+		
+		AFTER_ALL({
+			DBFS::stop_reaper();
+		});
+		
+		IT("remove should succeed without removing directories itself", {
+			bool ok = true;
+			for(int i=0;i<20;i++){
+				ok = ok && DBFS::remove("qr" + to_string(i) + "reaper");
+			}
+			EXPECT(ok).toBe(true);
+			EXPECT(DBFS::exists("qr0reaper")).toBe(false);
+		});
+		
+		IT("file can be created again in a reaped directory", {
+			DBFS::File* f = DBFS::create("qr0reaper");
+			EXPECT(f->is_open()).toBe(true);
+			delete f;
+			DBFS::remove("qr0reaper");
+		});
+		
+		IT("empty directories should be gone once reaper is stopped", {
+			DBFS::stop_reaper();
+			EXPECT(::stat("tmp/qr", &sb)).toBe(-1);
+		});
+	});
+	
+	DESCRIBE("In-memory catalog", {
+		std::vector<string> names;
+		
+		BEFORE_ALL({
+			for(int i=0;i<30;i++){
+				names.push_back(DBFS::random_filename());
+				DBFS::create(names.back())->close();
+			}
+			DBFS::load_catalog(3);
+		});
+		
+		AFTER_ALL({
+			DBFS::drop_catalog();
+			for(auto& it : names){
+				DBFS::remove(it);
+			}
+		});
+		
+		IT("should load existing files", {
+			bool ok = true;
+			for(auto& it : names){
+				ok = ok && DBFS::exists(it);
+			}
+			EXPECT(ok).toBe(true);
+			EXPECT(DBFS::catalog_size()).toBeGreaterThanOrEqual(names.size());
+		});
+		
+		IT("should follow create, move and remove", {
+			DBFS::File* f = DBFS::create();
+			string name = f->name();
+			EXPECT(DBFS::exists(name)).toBe(true);
+			string new_name = DBFS::random_filename();
+			f->move(new_name);
+			EXPECT(DBFS::exists(name)).toBe(false);
+			EXPECT(DBFS::exists(new_name)).toBe(true);
+			f->remove();
+			EXPECT(DBFS::exists(new_name)).toBe(false);
+			delete f;
+		});
+		
+		IT("should not touch the disk", {
+			DBFS::File* f = DBFS::create();
+			string name = f->name();
+			f->close();
+			std::remove(DBFS::get_file_path(name).c_str());
+			EXPECT(DBFS::exists(name)).toBe(true);
+			DBFS::details::catalog_erase(name);
+			delete f;
+		});
+		
+		IT("should create a file the catalog wrongly knows", {
+			string name = DBFS::random_filename();
+			DBFS::details::catalog_add(name);
+			DBFS::File* f = DBFS::create(name);
+			EXPECT(f->is_open()).toBe(true);
+			f->remove();
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Persistent manifest", {
+		std::vector<string> names;
+		auto sizes = [](){
+			std::map<string, long> m;
+			for(auto& it : DBFS::manifest::list()){
+				m[it.name] = it.size;
+			}
+			return m;
+		};
+		
+		BEFORE_ALL({
+			DBFS::set_root("tmp_manifest");
+			for(int i=0;i<10;i++){
+				names.push_back(DBFS::random_filename());
+				DBFS::File* f = DBFS::create(names.back());
+				f->write(&names.back()[0], i);
+				delete f;
+			}
+		});
+		
+		AFTER_ALL({
+			DBFS::manifest::close();
+			for(auto& it : names){
+				DBFS::remove(it);
+			}
+			std::remove("tmp_manifest/.manifest");
+			DBFS::details::rmdir("tmp_manifest");
+			DBFS::set_root("tmp");
+		});
+		
+		IT("should scan root when there is no log", {
+			EXPECT(DBFS::manifest::open()).toBe(false);
+			EXPECT(sizes().size()).toBe((size_t)10);
+			EXPECT(sizes()[names[3]]).toBe(3L);
+		});
+		
+		IT("should track create, write, move and remove", {
+			DBFS::File* f = DBFS::create();
+			f->write(&names[0][0], 5);
+			string name = DBFS::random_filename();
+			f->move(name);
+			delete f;
+			DBFS::remove(names[9]);
+			names[9] = name;
+			auto m = sizes();
+			EXPECT(m.size()).toBe((size_t)10);
+			EXPECT(m[name]).toBe(5L);
+		});
+		
+		IT("should load listing from log after clean close", {
+			auto m = sizes();
+			DBFS::manifest::close();
+			EXPECT(DBFS::manifest::open()).toBe(true);
+			EXPECT(sizes() == m).toBe(true);
+		});
+		
+		IT("should compact the log in background", {
+			auto m = sizes();
+			string a = names[0], b = DBFS::random_filename();
+			for(int i=0;i<1100;i++){
+				DBFS::move(a, b);
+				std::swap(a, b);
+			}
+			auto lines = [](){
+				std::ifstream in("tmp_manifest/.manifest");
+				return std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n');
+			};
+			for(int i=0;i<200 && lines() > 100;i++){
+				this_thread::sleep_for(chrono::milliseconds(10));
+			}
+			EXPECT(lines() <= 100).toBe(true);
+			DBFS::manifest::close();
+			EXPECT(DBFS::manifest::open()).toBe(true);
+			EXPECT(sizes() == m).toBe(true);
+		});
+		
+		IT("should rewrite a log with a damaged record from memory", {
+			auto m = sizes();
+			{
+				// Size digit of the second record, its checksum no longer matches
+				std::fstream log("tmp_manifest/.manifest", std::ios::in | std::ios::out | std::ios::binary);
+				string first;
+				std::getline(log, first);
+				log.seekp(first.size() + 3);
+				log.put('#');
+			}
+			string a = names[0], b = DBFS::random_filename();
+			for(int i=0;i<1100;i++){
+				DBFS::move(a, b);
+				std::swap(a, b);
+			}
+			auto lines = [](){
+				std::ifstream in("tmp_manifest/.manifest");
+				return std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n');
+			};
+			for(int i=0;i<200 && lines() > 1000;i++){
+				this_thread::sleep_for(chrono::milliseconds(10));
+			}
+			EXPECT(lines() <= 1000).toBe(true);
+			DBFS::manifest::close();
+			EXPECT(DBFS::manifest::open()).toBe(true);
+			EXPECT(sizes() == m).toBe(true);
+		});
+		
+		IT("should scan root when log is stale", {
+			auto m = sizes();
+			DBFS::manifest::close();
+			std::ofstream("tmp_manifest/.manifest", std::ios::app) << "C 1 zz 00000000\n";
+			EXPECT(DBFS::manifest::open()).toBe(false);
+			EXPECT(sizes() == m).toBe(true);
+		});
+	});
+	
+	DESCRIBE("Stream buffer", {
+		IT("should write and read through a custom sized buffer", {
+			DBFS::File* f = DBFS::create();
+			f->set_buffer_size(1 << 16);
+			f->open();
+			string data(100000, 'a');
+			for(int i=0;i<100000;i++){
+				data[i] = 'a' + i % 26;
+			}
+			for(int i=0;i<10;i++){
+				f->write(&data[0], data.size());
+			}
+			EXPECT(f->flush()).toBe(true);
+			char buf[16];
+			EXPECT(f->read_at(999990, buf, 10)).toBe(10);
+			EXPECT(string(buf, 10)).toBe(data.substr(99990, 10));
+			f->seekg(100000);
+			string back(100000, ' ');
+			f->read(&back[0], back.size());
+			EXPECT(back == data).toBe(true);
+			EXPECT(f->tellg()).toBe(200000);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should apply global buffer size to new files", {
+			DBFS::set_buffer_size(4096);
+			DBFS::File* f = DBFS::create();
+			string data = "buffered";
+			f->write(&data[0], data.size());
+			f->flush();
+			EXPECT(f->size()).toBe(8);
+			f->remove();
+			delete f;
+			DBFS::set_buffer_size(0);
+		});
+	});
+	
+	DESCRIBE("Direct I/O", {
+		IT("should transfer aligned blocks", {
+			DBFS::File* f = DBFS::create();
+			f->close();
+			f->set_direct(true);
+			f->open();
+			DBFS::iobuf out = DBFS::alloc_iobuf(8192);
+			DBFS::iobuf in = DBFS::alloc_iobuf(8192);
+			EXPECT((uintptr_t)out.data % DBFS::direct_align).toBe((uintptr_t)0);
+			for(int i=0;i<8192;i++){
+				out.data[i] = 'a' + i % 26;
+			}
+			EXPECT(f->write_at(4096, out.data, 8192)).toBe(8192);
+			EXPECT(f->read_at(4096, in.data, 8192)).toBe(8192);
+			EXPECT(std::memcmp(in.data, out.data, 8192)).toBe(0);
+			INFO_PRINT(string("O_DIRECT: ") + (f->is_direct() ? "yes" : "not supported"));
+			DBFS::free_iobuf(out);
+			DBFS::free_iobuf(in);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should refuse unaligned requests", {
+			DBFS::File* f = DBFS::create();
+			f->close();
+			f->set_direct(true);
+			f->open();
+			DBFS::iobuf buf = DBFS::alloc_iobuf(4096);
+			EXPECT(f->write_at(1, buf.data, 4096)).toBe(-1);
+			EXPECT(f->write_at(0, buf.data, 100)).toBe(-1);
+			EXPECT(f->write_at(0, buf.data + 1, 4095)).toBe(-1);
+			DBFS::free_iobuf(buf);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should switch the mode of an open file", {
+			DBFS::File* f = DBFS::create();
+			f->close();
+			f->set_direct(true);
+			f->open();
+			DBFS::iobuf buf = DBFS::alloc_iobuf(4096);
+			std::memset(buf.data, 'd', 4096);
+			EXPECT(f->write_at(0, buf.data, 4096)).toBe(4096);
+			bool supported = f->is_direct();
+			f->set_direct(false);
+			EXPECT(f->is_direct()).toBe(false);
+			EXPECT(f->write_at(1, buf.data, 10)).toBe(10);
+			f->set_direct(true);
+			EXPECT(f->is_direct()).toBe(supported);
+			EXPECT(f->read_at(0, buf.data, 4096)).toBe(4096);
+			DBFS::free_iobuf(buf);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should reuse freed buffers", {
+			DBFS::use_huge_pages(true);
+			DBFS::iobuf a = DBFS::alloc_iobuf(3 << 20);
+			EXPECT(a.size).toBe((DBFS::pos_t)4 << 20);
+			EXPECT(a.data != nullptr).toBe(true);
+			a.data[a.size - 1] = 1;
+			DBFS::free_iobuf(a);
+			DBFS::iobuf b = DBFS::alloc_iobuf(4 << 20);
+			EXPECT(b.data == a.data).toBe(true);
+			DBFS::free_iobuf(b);
+			DBFS::use_huge_pages(false);
+		});
+	});
+	
+	DESCRIBE("Binary values", {
+		IT("should write fixed width values and read them back", {
+			struct node{ uint32_t id; uint16_t flags; };
+			std::vector<uint64_t> keys(1000);
+			for(size_t i=0;i<keys.size();i++){
+				keys[i] = i * 0x0101010101ULL;
+			}
+			DBFS::File* f = DBFS::create();
+			f->write_binary(keys);
+			f->write_binary(3.5);
+			f->write_binary(node{7, 3});
+			f->write_binary(keys.data(), 2);
+			EXPECT(f->size()).toBe((DBFS::pos_t)(1002 * sizeof(uint64_t) + sizeof(double) + sizeof(node)));
+			
+			f->seekg(0);
+			std::vector<uint64_t> back(1000);
+			double d;
+			node n;
+			uint64_t tail[2];
+			f->read_binary(back);
+			f->read_binary(d);
+			f->read_binary(n);
+			f->read_binary(tail, 2);
+			EXPECT(back == keys).toBe(true);
+			EXPECT(d).toBe(3.5);
+			EXPECT(n.id).toBe((uint32_t)7);
+			EXPECT(tail[1]).toBe(keys[1]);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should store little endian by default", {
+			DBFS::File* f = DBFS::create();
+			f->write_binary((uint32_t)0x01020304);
+			f->seekg(0);
+			char b[4];
+			f->read(b, 4);
+			EXPECT((int)b[0]).toBe(4);
+			uint32_t v = 0x01020304;
+			DBFS::details::byteswap(&v, 1);
+			EXPECT(v).toBe((uint32_t)0x04030201);
+			f->remove();
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Text values", {
+		IT("should format and parse numbers", {
+			DBFS::File* f = DBFS::create();
+			f->write_text(-42);
+			f->write(const_cast<char*>(" "), 1);
+			f->write_text(2.5);
+			f->seekg(0);
+			int i;
+			double d;
+			EXPECT(f->read_text(i)).toBe(true);
+			EXPECT(f->read_text(d)).toBe(true);
+			EXPECT(i).toBe(-42);
+			EXPECT(d).toBe(2.5);
+			EXPECT(f->read_text(i)).toBe(false);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should fail on numbers longer than 64 characters", {
+			DBFS::File* f = DBFS::create();
+			string text = string(80, '0') + "1.5";
+			f->write(&text[0], text.size());
+			f->seekg(0);
+			double d = 0;
+			EXPECT(f->read_text(d)).toBe(false);
+			EXPECT(f->fail()).toBe(true);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should write and read ranges with a separator", {
+			std::vector<long> values;
+			for(long i=0;i<20000;i++){
+				values.push_back(i * 37 - 5000);
+			}
+			DBFS::File* f = DBFS::create();
+			f->write_all(values, ',');
+			f->seekg(0);
+			std::vector<long> back(values.size());
+			EXPECT(f->read_all(back, ',')).toBe(values.size());
+			EXPECT(back == values).toBe(true);
+			f->seekg(0);
+			char head[12];
+			f->read(head, 11);
+			EXPECT(string(head, 11)).toBe("-5000,-4963");
+			f->remove();
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Durability", {
+		IT("should sync a file and its directory", {
+			DBFS::File* f = DBFS::create();
+			f->write_text(1);
+			EXPECT(f->sync()).toBe(true);
+			EXPECT(DBFS::sync_dir(f->name())).toBe(true);
+			EXPECT(DBFS::commit(f)).toBe(true);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should sync files of many threads in shared batches", {
+			DBFS::start_group_commit(2000);
+			std::atomic<int> ok{0};
+			vector<thread> v;
+			for(int i=0;i<16;i++){
+				v.emplace_back([&ok](){
+					DBFS::File* f = DBFS::create();
+					for(int j=0;j<10;j++){
+						f->write_text(j);
+						if(DBFS::commit(f)){
+							ok++;
+						}
+					}
+					f->remove();
+					delete f;
+				});
+			}
+			for(auto& it : v){
+				it.join();
+			}
+			DBFS::stop_group_commit();
+			EXPECT(ok.load()).toBe(160);
+		});
+	});
+	
+	DESCRIBE("Atomic replace", {
+		string name;
+		auto content = [&name](){
+			DBFS::File f(name);
+			string s(f.size(), ' ');
+			f.seekg(0);
+			f.read(&s[0], s.size());
+			return s;
+		};
+		
+		BEFORE_ALL({
+			name = DBFS::random_filename();
+		});
+		
+		AFTER_ALL({
+			DBFS::remove(name);
+		});
+		
+		IT("should replace whole file content", {
+			auto write = [](string text){
+				return [text](DBFS::File& f){
+					f.write(const_cast<char*>(text.data()), text.size());
+					return true;
+				};
+			};
+			EXPECT(DBFS::replace_atomic(name, write("first version"))).toBe(true);
+			EXPECT(content()).toBe("first version");
+			EXPECT(DBFS::replace_atomic(name, write("second"), false)).toBe(true);
+			EXPECT(content()).toBe("second");
+		});
+		
+		IT("should keep old content when writer fails", {
+			string dir = DBFS::get_file_path(name);
+			dir = dir.substr(0, dir.rfind('/'));
+			std::vector<string> before, after;
+			DBFS::details::list_dir(dir, before, false);
+			EXPECT(DBFS::replace_atomic(name, [](DBFS::File& f){
+				f.write_text(1);
+				return false;
+			})).toBe(false);
+			DBFS::details::list_dir(dir, after, false);
+			EXPECT(content()).toBe("second");
+			EXPECT(after.size()).toBe(before.size());
+		});
+		
+		IT("should keep file open under the new name", {
+			DBFS::File* f = DBFS::create();
+			f->write_text(7);
+			DBFS::start_group_commit();
+			EXPECT(f->commit_as(name)).toBe(true);
+			DBFS::stop_group_commit();
+			EXPECT(f->name()).toBe(name);
+			f->write_text(8);
+			f->flush();
+			EXPECT(content()).toBe("78");
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Space management", {
+		IT("should preallocate without changing size", {
+			DBFS::File* f = DBFS::create();
+			EXPECT(f->reserve(1 << 20)).toBe(true);
+			EXPECT(f->size()).toBe(0);
+			struct stat sb;
+			::stat(DBFS::get_file_path(f->name()).c_str(), &sb);
+			EXPECT(sb.st_blocks * 512 >= (1 << 20)).toBe(true);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should shrink and extend files", {
+			DBFS::File* f = DBFS::create();
+			string data(100, 'a');
+			f->write(&data[0], data.size());
+			EXPECT(f->truncate(10)).toBe(true);
+			EXPECT(f->size()).toBe(10);
+			EXPECT(f->truncate(50)).toBe(true);
+			EXPECT(f->size()).toBe(50);
+			char buf[50];
+			EXPECT(f->read_at(0, buf, 50)).toBe(50);
+			EXPECT(buf[9]).toBe('a');
+			EXPECT(buf[10]).toBe('\0');
+			f->remove();
+			delete f;
+		});
+		
+		IT("should free a range in the middle", {
+			DBFS::File* f = DBFS::create();
+			string data(65536, 'a');
+			f->write(&data[0], data.size());
+			EXPECT(f->punch_hole(4096, 8192)).toBe(true);
+			EXPECT(f->size()).toBe(65536);
+			char buf[3];
+			f->read_at(4095, buf, 3);
+			EXPECT(string(buf, 3) == string("a\0\0", 3)).toBe(true);
+			f->read_at(12287, buf, 3);
+			EXPECT(string(buf, 3) == string("\0aa", 3)).toBe(true);
+			f->remove();
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Access hints", {
+		IT("should accept hints for the whole file and ranges", {
+			DBFS::File* f = DBFS::create();
+			string data(8192, 'a');
+			f->write(&data[0], data.size());
+			f->flush();
+			EXPECT(f->advise(DBFS::SEQUENTIAL)).toBe(true);
+			EXPECT(f->advise(DBFS::WILLNEED, 0, 4096)).toBe(true);
+			EXPECT(f->advise(DBFS::WILLNEED)).toBe(true);
+			EXPECT(f->advise(DBFS::RANDOM, 4096, 4096)).toBe(true);
+			EXPECT(f->advise(DBFS::DONTNEED)).toBe(true);
+			f->remove();
+			delete f;
+		});
+		
+		IT("should read whole file in scan mode", {
+			DBFS::File* f = DBFS::create();
+			string data(3 << 20, ' ');
+			for(size_t i=0;i<data.size();i++){
+				data[i] = 'a' + i % 23;
+			}
+			f->write(&data[0], data.size());
+			f->sync();
+			f->set_scan(true);
+			f->seekg(0);
+			string back(data.size(), ' ');
+			for(size_t i=0;i<back.size();i+=1<<16){
+				f->read(&back[i], 1 << 16);
+			}
+			EXPECT(back == data).toBe(true);
+			// Going back after pages were dropped reads them from disk again
+			f->seekg(4096);
+			char buf[4];
+			f->read(buf, 4);
+			EXPECT(string(buf, 4)).toBe(data.substr(4096, 4));
+			EXPECT(f->read_at(1 << 20, buf, 4)).toBe(4);
+			EXPECT(string(buf, 4)).toBe(data.substr(1 << 20, 4));
+			f->remove();
+			delete f;
+		});
+	});
+	
+	DESCRIBE("Block cache", {
+		string name;
+		string data(64 * 4096, ' ');
+		
+		BEFORE_ALL({
+			DBFS::set_cache_size(1 << 20);
+			for(size_t i=0;i<data.size();i++){
+				data[i] = 'a' + (i / 7) % 26;
+			}
+			DBFS::File f;
+			f.open(name = DBFS::random_filename());
+			f.write(&data[0], data.size());
+		});
+		
+		AFTER_ALL({
+			DBFS::remove(name);
+			DBFS::set_cache_size(0);
+		});
+		
+		IT("should serve reads of all instances of a file", {
+			DBFS::File a(name), b(name);
+			char x[100], y[100];
+			EXPECT(a.read_at(4090, x, 100)).toBe(100);
+			EXPECT(b.read_at(4090, y, 100)).toBe(100);
+			EXPECT(string(x, 100)).toBe(data.substr(4090, 100));
+			EXPECT(string(y, 100)).toBe(data.substr(4090, 100));
+			EXPECT(a.read_at(data.size() - 10, x, 100)).toBe(10);
+		});
+		
+		IT("should see writes of other instances", {
+			DBFS::File a(name), b(name);
+			char x[4];
+			a.read_at(8192, x, 4);
+			b.write_at(8192, "wxyz", 4);
+			EXPECT(a.read_at(8192, x, 4)).toBe(4);
+			EXPECT(string(x, 4)).toBe("wxyz");
+			b.seekp(8196);
+			b.write(const_cast<char*>("1234"), 4);
+			b.flush();
+			EXPECT(a.read_at(8192, x, 4)).toBe(4);
+			a.read_at(8196, x, 4);
+			EXPECT(string(x, 4)).toBe("1234");
+			data.replace(8192, 8, "wxyz1234");
+		});
+		
+		IT("should see async writes", {
+			DBFS::File a(name);
+			char x[4];
+			a.read_at(12288, x, 4);
+			EXPECT(DBFS::async::write(&a, 12288, "asyn", 4).get()).toBe(4);
+			a.read_at(12288, x, 4);
+			EXPECT(string(x, 4)).toBe("asyn");
+			data.replace(12288, 4, "asyn");
+		});
+		
+		IT("should see stream writes before flush", {
+			DBFS::File a(name), b(name);
+			char x[4];
+			a.read_at(16384, x, 4);
+			a.read_at(200000, x, 4);
+			string fill(data.size() - 16384, '#');
+			b.seekp(16384);
+			b.write(&fill[0], fill.size());
+			a.read_at(16384, x, 4);
+			EXPECT(string(x, 4)).toBe("####");
+			b.flush();
+			a.read_at(200000, x, 4);
+			EXPECT(string(x, 4)).toBe("####");
+			data.replace(16384, fill.size(), fill);
+		});
+		
+		IT("should leave cached blocks alone while writes stay in the stream buffer", {
+			DBFS::File a(name), b(name);
+			char x[4];
+			a.read_at(20480, x, 4);
+			unsigned long long renames;
+			unsigned long long epoch = DBFS::details::cache_epoch(name, renames);
+			b.seekp(20480);
+			b.write(const_cast<char*>("buf!"), 4);
+			EXPECT(DBFS::details::cache_epoch(name, renames)).toBe(epoch);
+			b.flush();
+			a.read_at(20480, x, 4);
+			EXPECT(string(x, 4)).toBe("buf!");
+			data.replace(20480, 4, "buf!");
+		});
+		
+		IT("should keep data correct when blocks are replaced", {
+			DBFS::set_cache_size(64 * 2 * 4096);
+			DBFS::File a(name);
+			bool same = true;
+			for(int round=0;round<3;round++){
+				for(size_t i=0;i<data.size();i+=4096){
+					char x[16];
+					a.read_at(i + 100, x, 16);
+					same = same && string(x, 16) == data.substr(i + 100, 16);
+				}
+			}
+			EXPECT(same).toBe(true);
+		});
+		
+		IT("should drop blocks of a replaced file", {
+			DBFS::File a(name);
+			char x[4];
+			a.read_at(0, x, 4);
+			DBFS::replace_atomic(name, [](DBFS::File& f){
+				f.write(const_cast<char*>("new!"), 4);
+				return true;
+			}, false);
+			EXPECT(a.read_at(0, x, 4) == 4 && string(x, 4) != "new!").toBe(true);
+			DBFS::File b(name);
+			EXPECT(b.read_at(0, x, 4)).toBe(4);
+			EXPECT(string(x, 4)).toBe("new!");
+		});
+	});
+	
+	DESCRIBE("Reader/writer lock", {
+		DBFS::File* f = nullptr;
+		
+		BEFORE_ALL({
+			f = DBFS::create();
+			f->write(const_cast<char*>("aaaaaaaa"), 8);
+			f->flush();
+		});
+		
+		AFTER_ALL({
+			f->remove();
+			delete f;
+		});
+		
+		IT("should let readers hold the lock together", {
+			std::atomic<int> inside{0}, most{0};
+			vector<thread> threads;
+			for(int i=0;i<4;i++){
+				threads.emplace_back([&](){
+					auto lock = f->get_shared_lock();
+					++inside;
+					for(int j=0;j<100 && inside.load() < 4;j++){
+						this_thread::sleep_for(chrono::milliseconds(5));
+					}
+					int n = inside.load(), m = most.load();
+					while(n > m && !most.compare_exchange_weak(m, n));
+					--inside;
+				});
+			}
+			for(auto& it : threads){
+				it.join();
+			}
+			EXPECT(most.load()).toBe(4);
+		});
+		
+		IT("should keep readers out while a writer holds it", {
+			std::atomic<bool> stop{false};
+			std::atomic<int> torn{0};
+			vector<thread> readers;
+			for(int i=0;i<4;i++){
+				readers.emplace_back([&](){
+					char buf[8];
+					while(!stop){
+						auto lock = f->get_shared_lock();
+						f->read_at(0, buf, 8);
+						if(string(buf, 8) != string(8, buf[0])){
+							torn++;
+						}
+					}
+				});
+			}
+			for(int i=0;i<200;i++){
+				auto lock = f->get_unique_lock();
+				char c = 'a' + i % 26;
+				f->write_at(0, string(4, c).c_str(), 4);
+				this_thread::yield();
+				f->write_at(4, string(4, c).c_str(), 4);
+			}
+			stop = true;
+			for(auto& it : readers){
+				it.join();
+			}
+			EXPECT(torn.load()).toBe(0);
+		});
+		
+		IT("should record wait and hold times in metrics", {
+			DBFS::metrics::reset();
+			{
+				auto lock = f->get_unique_lock();
+			}
+			{
+				auto lock = f->get_shared_lock();
+				EXPECT(f->get_rw_mutex().try_lock()).toBe(false);
+			}
+			auto snap = DBFS::metrics::get_snapshot();
+			EXPECT(snap[DBFS::metrics::LOCK_WAIT].calls).toBe(2ULL);
+			EXPECT(snap[DBFS::metrics::LOCK_HOLD].calls).toBe(2ULL);
+		});
+	});
+	
+	DESCRIBE("Packed objects", {
+		std::vector<string> names;
+		
+		BEFORE_ALL({
+			DBFS::pack::open("tmp/.pack", 4096);
+		});
+		
+		AFTER_ALL({
+			DBFS::pack::close();
+			std::vector<string> files;
+			DBFS::details::list_dir("tmp/.pack", files, false);
+			for(auto& it : files){
+				std::remove(it.c_str());
+			}
+			DBFS::details::rmdir("tmp/.pack");
+		});
+		
+		IT("should write and read back an object", {
+			DBFS::pack::File* f = DBFS::pack::create();
+			names.push_back(f->name());
+			f->write(123);
+			f->write(' ');
+			f->write("abc");
+			f->close();
+			f->open();
+			int i;
+			string s;
+			f->read(i);
+			f->read(s);
+			EXPECT(i).toBe(123);
+			EXPECT(s).toBe("abc");
+			EXPECT(f->size()).toBe(7);
+			delete f;
+			EXPECT(DBFS::pack::exists(names[0])).toBe(true);
+		});
+		
+		IT("should store a new object on the first flush", {
+			DBFS::pack::File f(DBFS::random_filename());
+			EXPECT(f.is_open()).toBe(true);
+			EXPECT(DBFS::pack::exists(f.name())).toBe(false);
+			EXPECT(f.flush()).toBe(true);
+			EXPECT(DBFS::pack::exists(f.name())).toBe(true);
+			EXPECT(f.remove()).toBe(true);
+		});
+		
+		IT("should move and remove objects", {
+			string name = DBFS::random_filename();
+			DBFS::pack::File f(names[0]);
+			EXPECT(f.move(name)).toBe(true);
+			EXPECT(DBFS::pack::exists(names[0])).toBe(false);
+			EXPECT(DBFS::pack::exists(name)).toBe(true);
+			EXPECT(f.remove()).toBe(true);
+			EXPECT(DBFS::pack::exists(name)).toBe(false);
+			names.clear();
+		});
+		
+		IT("should rebuild index from segments on open", {
+			string data(100, 'x');
+			for(int i=0;i<100;i++){
+				DBFS::pack::File f(DBFS::random_filename());
+				f.write(&data[0], data.size());
+				names.push_back(f.name());
+			}
+			DBFS::pack::close();
+			EXPECT(DBFS::pack::open("tmp/.pack", 4096)).toBe(true);
+			EXPECT(DBFS::pack::list().size()).toBe((size_t)100);
+			DBFS::pack::File f(names[50]);
+			EXPECT(f.size()).toBe(100);
+		});
+		
+		IT("should reclaim space of removed objects on compaction", {
+			for(int i=0;i<90;i++){
+				DBFS::pack::remove(names[i]);
+			}
+			EXPECT(DBFS::pack::compact() > 0).toBe(true);
+			DBFS::pack::close();
+			EXPECT(DBFS::pack::open("tmp/.pack", 4096)).toBe(true);
+			EXPECT(DBFS::pack::list().size()).toBe((size_t)10);
+			EXPECT(DBFS::pack::exists(names[0])).toBe(false);
+			EXPECT(DBFS::pack::exists(names[95])).toBe(true);
+		});
+	});
+	
 	DESCRIBE("Multithreading test", {
 		std::mutex mtx;
 		std::unordered_set<string> files;
@@ -344,6 +1670,54 @@ DESCRIBE("DBFS", {
 			});
 		});
 		
+		DESCRIBE("Generate random file names from many threads", {
+			IT("Should never repeat a name even with short random part", {
+				DBFS::set_filename_length(1);
+				vector<vector<string>> names(8);
+				vector<thread> v;
+				for(int i=0;i<8;i++){
+					v.emplace_back([&names](int ind){
+						for(int j=0;j<5000;j++){
+							names[ind].push_back(DBFS::random_filename());
+						}
+					}, i);
+				}
+				for(auto& it : v){
+					it.join();
+				}
+				DBFS::set_filename_length(10);
+				unordered_set<string> all;
+				for(auto& it : names){
+					all.insert(it.begin(), it.end());
+				}
+				EXPECT((int)all.size()).toBe(8*5000);
+			});
+		});
+		
+		DESCRIBE("Create and remove files sharing first level directory", {
+			IT("Should always create file even when parent directory is removed concurrently", {
+				std::atomic<int> failed{0};
+				vector<thread> v;
+				for(int i=0;i<8;i++){
+					v.emplace_back([&failed](int ind){
+						for(int j=0;j<200;j++){
+							string name = "zz" + to_string(ind) + "x" + to_string(j);
+							DBFS::File* f = DBFS::create(name);
+							if(!f->is_open() || !DBFS::exists(name)){
+								failed++;
+							}
+							delete f;
+							DBFS::remove(name);
+						}
+					}, i);
+				}
+				for(auto& it : v){
+					it.join();
+				}
+				EXPECT(failed.load()).toBe(0);
+			});
+		});
+		
 		DESCRIBE("get_lock should work and block file from being writed from second thread", {
 			DBFS::File* f = DBFS::create();
 			BEFORE_ALL({